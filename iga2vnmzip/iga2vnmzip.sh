@@ -6,53 +6,6 @@ help() {
     echo 'Usage: iga2vnmzip FLOWERS_DIRECTORY OUTPUT.vnm.zip|OUTPUT_DIRECTORY/' >&2
 }
 
-name_to_type() {
-    case "$1" in
-        bgimage)
-            echo background
-            ;;
-        bgm)
-            echo music
-            ;;
-        fgimage)
-            echo foreground
-            ;;
-        se)
-            echo sound
-            ;;
-        system)
-            echo template
-            ;;
-        *)
-            echo "$1"
-            ;;
-    esac
-}
-
-data_to_name() {
-    case "$1" in
-        data00)
-            echo script
-            ;;
-        data01)
-            echo fgimage
-            ;;
-        data02)
-            echo bgimage
-            ;;
-        data03)
-            echo system
-            ;;
-        data04)
-            echo bgm
-            ;;
-        *)
-            echo "Unknown data $1" >&2
-            exit 1
-            ;;
-    esac
-}
-
 main() {
     if [[ $# -ne 2 || ! -d "$1" || ! ( "$2" == */ || "$2" == *.vnm.zip ) ]]; then
         help
@@ -75,45 +28,7 @@ main() {
         mkdir -p "$output_dir"
     fi
 
-    for f in "$1/"*.iga; do
-        if [[ "$f" == *data*.iga ]]; then
-            continue
-        fi
-        echo "Extracting $f..."
-        d="$output_dir/$(name_to_type "$(basename "$f" .iga)")"
-        mkdir "$d"
-        ../igatool/igatool -x "$f" "$d"
-    done
-    if [[ -d "$1/%DEFAULT FOLDER%" ]]; then
-        for f in "$1/%DEFAULT FOLDER%/"*.iga; do
-            echo "Extracting $f..."
-            d="$output_dir/$(name_to_type "$(data_to_name "$(basename "$f" .iga)")")"
-            ../igatool/igatool -x "$f" "$d"
-        done
-    else
-        for f in "$1/"data*.iga; do
-            echo "Extracting $f..."
-            d="$output_dir/$(name_to_type "$(data_to_name "$(basename "$f" .iga)")")"
-            ../igatool/igatool -x "$f" "$d"
-        done
-    fi
-
-    echo "Lowercasing files..."
-    for d in "$output_dir/"*/; do
-        for f in "$d"*; do
-            if [[ "$f" == *'*' ]]; then
-                break
-            fi
-            local f2
-            f2="${f,,}"
-            if [[ "$f" != "$f2" ]]; then
-                mv "$f" "$f2"
-            fi
-        done
-    done
-
-    echo "Removing extraneous files..."
-    rm -f "$output_dir/foreground/ev08b.bmp"
+    ../igatool/igatool --plan -j 0 iga2vnmzip.plan "$1" "$output_dir"
 
     echo "Copying manifest..."
     cp manifest.yaml "$output_dir/"
@@ -131,17 +46,6 @@ main() {
         cp "$f" "$output_dir/vnmark/"
     done
 
-    echo "Moving avatars..."
-    mkdir -p "$output_dir/avatar"
-    for f in "$output_dir/foreground/f"*; do
-        mv "$f" "$output_dir/avatar/"
-    done
-
-    echo "Moving template sounds..."
-    for f in "$output_dir/sound/sys_"*; do
-        mv "$f" "$output_dir/template/"
-    done
-
     echo "Converting script to VNMark..."
     kotlin ../igs2vnm/igs2vnm.main.kts "$output_dir/script" "$output_dir/vnmark"
     rm -r "$output_dir/script"
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Checks that igatool -c and --stream refuse inputs whose sizes or offsets don't fit in a 31-bit
+# packed uint32, using sparse files and manifests so that no data is read or written.
+# Usage: compress_limits_test.sh IGATOOL
+igatool=$1
+directory=$(mktemp -d) || exit 1
+trap 'rm -rf "$directory"' EXIT
+status=0
+
+# Expects igatool -c to fail with the message, without writing the archive.
+expect_rejected() {
+    message=$1
+    shift
+    if "$igatool" -c "$directory/out.iga" "$@" 2>"$directory/error"; then
+        echo "FAIL: accepted $*"
+        status=1
+    elif ! grep -q "$message" "$directory/error"; then
+        echo "FAIL: expected \"$message\" for $*, got: $(cat "$directory/error")"
+        status=1
+    elif [ -e "$directory/out.iga" ]; then
+        echo "FAIL: wrote an archive for $*"
+        status=1
+    fi
+}
+
+# Expects igatool --stream manifest to fail with the message on the manifest, without writing the
+# archive.
+expect_manifest_rejected() {
+    message=$1
+    manifest=$2
+    if printf "$manifest" | "$igatool" --stream manifest "$directory/out.iga" \
+            2>"$directory/error"; then
+        echo "FAIL: accepted manifest $manifest"
+        status=1
+    elif ! grep -q "$message" "$directory/error"; then
+        echo "FAIL: expected \"$message\" for manifest $manifest, got: $(cat "$directory/error")"
+        status=1
+    elif [ -e "$directory/out.iga" ]; then
+        echo "FAIL: wrote an archive for manifest $manifest"
+        status=1
+    fi
+}
+
+truncate -s 2147483648 "$directory/2g_plus_1" && truncate -s +1 "$directory/2g_plus_1"
+truncate -s 1073741824 "$directory/1g_a" "$directory/1g_b"
+truncate -s 1 "$directory/one"
+truncate -s 2147483647 "$directory/max"
+
+expect_rejected "Input file size" "$directory/2g_plus_1"
+expect_rejected "Archive data size" "$directory/1g_a" "$directory/1g_b" "$directory/one"
+expect_rejected "Archive size" "$directory/max"
+
+expect_manifest_rejected "Invalid manifest line" 'a\t2147483648\n\n'
+expect_manifest_rejected "Archive data size" 'a\t1073741824\nb\t1073741824\nc\t1\n\n'
+expect_manifest_rejected "Archive size" 'a\t2147483647\n\n'
+
+# The tar entry is rejected from its header, before its data is read.
+if command -v tar >/dev/null; then
+    tar -cf - -C "$directory" 2g_plus_1 2>/dev/null \
+        | "$igatool" --stream tar "$directory/tar.iga" 2>"$directory/error"
+    if ! grep -q "Tar entry size" "$directory/error"; then
+        echo "FAIL: expected \"Tar entry size\" for a tar stream, got: $(cat "$directory/error")"
+        status=1
+    fi
+fi
+exit $status
@@ -1,47 +1,214 @@
 #!/bin/bash
 set -e
 if [[ "$#" -ne 1 ]]; then
-    echo "Usage: $0 STEAM_DIRECTORY" >&2
+    echo "Usage: $0 STEAM_DIRECTORY|-" >&2
+    echo "Reads names from standard input when given -." >&2
     exit 1
 fi
-names="$({
-    for file in "$1/steamapps/common/Flowers -Le volume sur "*-/*.iga; do
-        case "$(basename "$file")" in
-            bgimage.iga|fgimage.iga|script.iga|system.iga)
-                ./igatool -l "$file"
-            ;;
-        esac
-    done
-} | sort | uniq)"
-cat >encrypted_names.cpp <<EOF
-#include <memory>
-#include <string>
-#include <unordered_map>
+if [[ "$1" == - ]]; then
+    names="$(sort | uniq)"
+else
+    names="$({
+        for file in "$1/steamapps/common/Flowers -Le volume sur "*-/*.iga; do
+            case "$(basename "$file")" in
+                bgimage.iga|fgimage.iga|script.iga|system.iga)
+                    ./igatool -l "$file"
+                ;;
+            esac
+        done
+    } | sort | uniq)"
+fi
+echo "$names" | perl -e '
+use strict;
+use warnings;
+use integer;
+use Digest::MD5 qw(md5_hex);
+
+sub encrypt_name {
+    my ($name) = @_;
+    my $md5 = reverse(substr(md5_hex(lc($name)), -12));
+    my $encrypted_name = "";
+    my $index = 0;
+    for my $char (split("", $md5)) {
+        my $ordinal = ord($char);
+        my $value = $ordinal + $index + 1;
+        if ($ordinal >= ord("0") && $ordinal <= ord("9")) {
+            $encrypted_name .= chr($value % 9 + ord("0"));
+        } else {
+            $encrypted_name .= chr($value % 25 + ord("a"));
+        }
+        ++$index;
+    }
+    return $encrypted_name;
+}
+
+# Must match PackEncryptedName() below.
+sub pack_key {
+    my ($encrypted_name) = @_;
+    my $key = 0;
+    for my $char (split("", $encrypted_name)) {
+        my $ordinal = ord($char);
+        $key = $key * 36 + ($ordinal <= ord("9") ? $ordinal - ord("0") : $ordinal - ord("a") + 10);
+    }
+    return $key;
+}
+
+# Must match HashEncryptedNameKey() below.
+sub hash_key {
+    my ($key, $seed) = @_;
+    my $hash = 2166136261 ^ $seed;
+    for my $i (0 .. 7) {
+        $hash ^= ($key >> (8 * $i)) & 0xFF;
+        $hash = ($hash * 16777619) & 0xFFFFFFFF;
+    }
+    return $hash;
+}
+
+my @names = grep { $_ ne "" } map { chomp; $_ } <STDIN>;
+my %names_by_key;
+for my $name (@names) {
+    my $key = pack_key(encrypt_name($name));
+    die "Encrypted name collision: $name, $names_by_key{$key}\n"
+        if exists $names_by_key{$key} && $names_by_key{$key} ne $name;
+    $names_by_key{$key} = $name;
+}
+my @keys = sort { $a <=> $b } keys %names_by_key;
+
+# Hash and displace: keys are grouped into buckets by hash_key($key, 0), and each bucket, largest
+# first, gets the smallest displacement that moves all its keys into free slots.
+my $bucket_count = int(@keys / 4) + 1;
+my $slot_count = int(@keys * 5 / 4) + 1;
+my @buckets = map { [] } 1 .. $bucket_count;
+for my $key (@keys) {
+    push(@{$buckets[hash_key($key, 0) % $bucket_count]}, $key);
+}
+my @displacements = (0) x $bucket_count;
+my @slots = (undef) x $slot_count;
+for my $bucket (sort { @{$buckets[$b]} <=> @{$buckets[$a]} || $a <=> $b } 0 .. $bucket_count - 1) {
+    next unless @{$buckets[$bucket]};
+    DISPLACEMENT: for my $displacement (1 .. 65535) {
+        my %taken;
+        for my $key (@{$buckets[$bucket]}) {
+            my $slot = hash_key($key, $displacement) % $slot_count;
+            next DISPLACEMENT if defined $slots[$slot] || $taken{$slot};
+            $taken{$slot} = $key;
+        }
+        $slots[$_] = $taken{$_} for keys %taken;
+        $displacements[$bucket] = $displacement;
+        last;
+    }
+    die "No displacement found for bucket $bucket\n" unless $displacements[$bucket];
+}
+
+my $pool = "";
+my %name_offsets;
+for my $key (@keys) {
+    $name_offsets{$key} = length($pool);
+    $pool .= $names_by_key{$key};
+}
+
+print <<EOF;
+// Generated by encrypted_names.sh, do not edit.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// The name pool is a single long string literal.
+#pragma GCC diagnostic ignored "-Woverlength-strings"
 
 using namespace std;
 
-unordered_map<string, string> CreateEncryptedNames() {
-    unordered_map<string, string> names{};
-$(echo "$names" | perl -lpe '
-use Digest::MD5 qw(md5_hex);
-$name = $_;
-$md5 = reverse(substr(md5_hex(lc($name)), -12));
-$encrypted_name = "";
-$index = 0;
-for $char (split("", $md5)) {
-    $ordinal = ord($char);
-    $value = $ordinal + $index + 1;
-    if ($ordinal >= ord("0") && $ordinal <= ord("9")) {
-        $encrypted_name = $encrypted_name . chr($value % 9 + ord("0"))
+namespace {
+
+struct EncryptedNameSlot {
+    uint64_t key;
+    uint32_t name_offset;
+    uint32_t name_length;
+};
+
+EOF
+printf("constexpr size_t ENCRYPTED_NAME_BUCKET_COUNT = %d;\n", $bucket_count);
+printf("constexpr size_t ENCRYPTED_NAME_SLOT_COUNT = %d;\n\n", $slot_count);
+print "constexpr char ENCRYPTED_NAME_POOL[] =\n";
+print "        \"$names_by_key{$_}\"\n" for @keys;
+print "        \"\";\n\n";
+print "constexpr uint16_t ENCRYPTED_NAME_DISPLACEMENTS[ENCRYPTED_NAME_BUCKET_COUNT] = {\n";
+print "    $_,\n" for @displacements;
+print "};\n\n";
+print "constexpr EncryptedNameSlot ENCRYPTED_NAME_SLOTS[ENCRYPTED_NAME_SLOT_COUNT] = {\n";
+for my $key (@slots) {
+    if (defined $key) {
+        printf("    { UINT64_C(%d), %d, %d },\n", $key, $name_offsets{$key},
+               length($names_by_key{$key}));
     } else {
-        $encrypted_name = $encrypted_name . chr($value % 25 + ord("a"));
+        print "    { 0, 0, 0 },\n";
     }
-    ++$index;
 }
-$_ = "    names.emplace(\"$encrypted_name\", \"$name\");"';
-)
-    return names;
+print "};\n\n";
+
+print <<EOF;
+uint32_t HashEncryptedNameKey(uint64_t key, uint32_t seed) {
+    uint32_t hash = UINT32_C(2166136261) ^ seed;
+    for (size_t i = 0; i < sizeof(key); ++i) {
+        hash ^= static_cast<uint8_t>(key >> (8 * i));
+        hash *= UINT32_C(16777619);
+    }
+    return hash;
 }
 
-unordered_map<string, string> ENCRYPTED_NAMES = CreateEncryptedNames();
+}
+
+EOF
+my $fingerprint = substr(md5_hex(join("\n", map { $names_by_key{$_} } @keys)), 0, 16);
+print "extern const uint64_t ENCRYPTED_NAMES_FINGERPRINT = UINT64_C(0x$fingerprint);\n\n";
+print <<EOF;
+// Packs 12 base36 characters into an integer, or returns false if it is not an encrypted name.
+bool PackEncryptedName(string_view encrypted_name, uint64_t &key) {
+    if (encrypted_name.size() != 12) {
+        return false;
+    }
+    key = 0;
+    for (char c : encrypted_name) {
+        uint64_t digit;
+        if (c >= '\''0'\'' && c <= '\''9'\'') {
+            digit = c - '\''0'\'';
+        } else if (c >= '\''a'\'' && c <= '\''z'\'') {
+            digit = c - '\''a'\'' + 10;
+        } else {
+            return false;
+        }
+        key = key * 36 + digit;
+    }
+    return true;
+}
+
+// Returns the name for a key packed by PackEncryptedName(), or an empty string if it is unknown.
+string_view FindEncryptedName(uint64_t key) {
+    uint32_t bucket = HashEncryptedNameKey(key, 0) % ENCRYPTED_NAME_BUCKET_COUNT;
+    const EncryptedNameSlot &slot = ENCRYPTED_NAME_SLOTS[
+            HashEncryptedNameKey(key, ENCRYPTED_NAME_DISPLACEMENTS[bucket])
+            % ENCRYPTED_NAME_SLOT_COUNT];
+    if (slot.name_length == 0 || slot.key != key) {
+        return {};
+    }
+    return { ENCRYPTED_NAME_POOL + slot.name_offset, slot.name_length };
+}
+
+// Returns the built-in names with their keys, in key order.
+vector<pair<uint64_t, string_view>> ListEncryptedNames() {
+    vector<pair<uint64_t, string_view>> names{};
+    for (const auto &slot : ENCRYPTED_NAME_SLOTS) {
+        if (slot.name_length != 0) {
+            names.emplace_back(slot.key, string_view{ ENCRYPTED_NAME_POOL + slot.name_offset,
+                                                      slot.name_length });
+        }
+    }
+    sort(names.begin(), names.end());
+    return names;
+}
 EOF
+' >encrypted_names.cpp
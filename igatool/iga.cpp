@@ -0,0 +1,473 @@
+#include "iga.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <system_error>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+MappedFile::MappedFile(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw system_error(errno, generic_category(), path);
+    }
+    if (fstat(fd, &status_) == -1) {
+        int error = errno;
+        close(fd);
+        throw system_error(error, generic_category(), path);
+    }
+    size_ = static_cast<size_t>(status_.st_size);
+    if (size_ > 0) {
+        void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            int error = errno;
+            close(fd);
+            throw system_error(error, generic_category(), path);
+        }
+        data_ = static_cast<const uint8_t *>(data);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        munmap(const_cast<uint8_t *>(data_), size_);
+    }
+}
+
+void MappedFile::Advise(int advice) const {
+    if (data_ != nullptr) {
+        // Only a hint, so failures are not fatal.
+        madvise(const_cast<uint8_t *>(data_), size_, advice);
+    }
+}
+
+// A packed uint32 stores 7-bit groups from the most significant one, each in bits 7-1 of a byte,
+// with bit 0 set only on the last byte.
+uint32_t ReadPackedUint32Slow(const uint8_t *&data, const uint8_t *end) {
+    uint32_t value = 0;
+    while ((value & 1u) == 0) {
+        if (data == end) {
+            throw out_of_range("Unexpected end of packed uint32");
+        }
+        value = value << 7u | *data++;
+    }
+    return value >> 1u;
+}
+
+uint32_t ReadPackedUint32(const uint8_t *&data, const uint8_t *end) {
+    // Name characters and small offsets take a single byte, for which the wide load below costs
+    // several times more than the byte itself.
+    if (data != end && (*data & 1u)) {
+        return *data++ >> 1u;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Decodes up to 8 bytes at once: find the last byte from the lowest set bit 0, move the
+    // groups into big-endian order and squeeze out the stop bits, without a branch per byte.
+    if (end - data >= static_cast<ptrdiff_t>(sizeof(uint64_t))) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        uint64_t stop_bits = word & UINT64_C(0x0101010101010101);
+        if (stop_bits != 0) {
+            unsigned length = __builtin_ctzll(stop_bits) / 8 + 1;
+            uint64_t groups = __builtin_bswap64(word) >> (8 * (sizeof(word) - length));
+            groups = (groups >> 1u) & UINT64_C(0x7F7F7F7F7F7F7F7F);
+            groups = (groups & UINT64_C(0x007F007F007F007F))
+                     | ((groups & UINT64_C(0x7F007F007F007F00)) >> 1u);
+            groups = (groups & UINT64_C(0x00003FFF00003FFF))
+                     | ((groups & UINT64_C(0x3FFF00003FFF0000)) >> 2u);
+            groups = (groups & UINT64_C(0x000000000FFFFFFF))
+                     | ((groups & UINT64_C(0x0FFFFFFF00000000)) >> 4u);
+            data += length;
+            // Same truncation as shifting the groups through a uint32 one by one.
+            return static_cast<uint32_t>(groups) & 0x7FFFFFFFu;
+        }
+    }
+#endif
+    return ReadPackedUint32Slow(data, end);
+}
+
+// Decodes the whole entry table, i.e. (name_offset, offset, size) triples until end.
+vector<Entry> ReadEntries(const uint8_t *&data, const uint8_t *end) {
+    vector<Entry> entries{};
+    // Every packed uint32 takes at least one byte.
+    entries.reserve((end - data) / 3);
+    while (data < end) {
+        entries.emplace_back();
+        Entry &entry = entries.back();
+        entry.name_offset = ReadPackedUint32(data, end);
+        entry.offset = ReadPackedUint32(data, end);
+        entry.size = ReadPackedUint32(data, end);
+    }
+    return entries;
+}
+
+bool WritePackedUint32Byte(ostream &stream, uint8_t byte, bool started, bool end) {
+    byte &= 0b01111111u;
+    started |= byte != 0;
+    if (started | end) {
+        byte <<= 1u;
+        if (end) {
+            byte |= 0b00000001u;
+        }
+        stream.write(reinterpret_cast<const char *>(&byte), sizeof(byte));
+    }
+    return started;
+}
+
+void WritePackedUint32(ostream &stream, uint32_t value) {
+    bool started = false;
+    started |= WritePackedUint32Byte(stream, value >> 28u, started, false);
+    started |= WritePackedUint32Byte(stream, value >> 21u, started, false);
+    started |= WritePackedUint32Byte(stream, value >> 14u, started, false);
+    started |= WritePackedUint32Byte(stream, value >> 7u, started, false);
+    WritePackedUint32Byte(stream, value, started, true);
+}
+
+void WritePackedString(ostream &stream, string_view value) {
+    // This doesn't handle encoding, but we should have ASCII-only names.
+    auto buffer = reinterpret_cast<const uint8_t *>(value.data());
+    for (size_t i = 0; i < value.length(); ++i) {
+        WritePackedUint32(stream, static_cast<uint32_t>(buffer[i]));
+    }
+}
+
+// Decodes all entry names into the single names arena, and points the entry names into it.
+void ReadNames(const uint8_t *&data, const uint8_t *end, vector<Entry> &entries, string &names) {
+    // Every packed uint32 takes at least one byte, so the arena is sized up front and filled
+    // without a capacity check per character.
+    names.resize(end - data);
+    size_t names_size = 0;
+    vector<size_t> name_ends(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (i < entries.size() - 1) {
+            size_t name_length = entries[i + 1].name_offset - entries[i].name_offset;
+            for (size_t j = 0; j < name_length; ++j) {
+                // This doesn't handle encoding, but we should have ASCII-only names, whose
+                // characters are single bytes.
+                if (data != end && (*data & 1u)) {
+                    names[names_size++] = static_cast<char>(*data++ >> 1u);
+                } else {
+                    names[names_size++] = static_cast<char>(ReadPackedUint32Slow(data, end));
+                }
+            }
+        } else {
+            // Assuming that entry names are in ASCII, the actual number of bytes used in the file
+            // for an entry name should be the same as the difference of name_offset of adjacent
+            // entries. However, Shenghuixinglanxueyuan somehow unnecessarily writes one extra 0
+            // byte before bytes that have their second-highest bit set to 1 (e.g. lower case
+            // letters), but they are still reporting the number of packed uint32s (instead of
+            // actual number of bytes used in the file) for name_offset, so that the file pointer
+            // will no longer be in sync with name_offset and it broke the simple logic of reading
+            // (names_end - name_offset of second last entry） packed uint32s. In this case, we can
+            // only read all the packed uint32s until we meet names_end.
+            while (data < end) {
+                names[names_size++] = static_cast<char>(ReadPackedUint32Slow(data, end));
+            }
+        }
+        name_ends[i] = names_size;
+    }
+    names.resize(names_size);
+    size_t name_begin = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i].name = string_view{names}.substr(name_begin, name_ends[i] - name_begin);
+        name_begin = name_ends[i];
+    }
+}
+
+// Two periods, so that the KEY_PERIOD keys from any offset in the first one are contiguous.
+struct alignas(64) KeyStream {
+    uint8_t keys[2 * KEY_PERIOD];
+};
+
+constexpr KeyStream CreateKeyStream(Cipher cipher) {
+    KeyStream key_stream{};
+    for (size_t i = 0; i < 2 * KEY_PERIOD; ++i) {
+        uint8_t key = static_cast<uint8_t>(i + 2);
+        if (cipher != Cipher::PLAIN) {
+            key ^= 0xFF;
+            if (cipher == Cipher::ENCRYPTED_SCRIPT) {
+                key ^= static_cast<uint8_t>(0x5C * (i + 1));
+            }
+        }
+        key_stream.keys[i] = key;
+    }
+    return key_stream;
+}
+
+constexpr KeyStream KEY_STREAMS[] = {
+    CreateKeyStream(Cipher::PLAIN),
+    CreateKeyStream(Cipher::SCRIPT),
+    CreateKeyStream(Cipher::ENCRYPTED_SCRIPT)
+};
+
+const uint8_t *GetKeyStream(Cipher cipher) {
+    return KEY_STREAMS[static_cast<size_t>(cipher)].keys;
+}
+
+Cipher GetCipher(string_view name, bool is_encrypted_name) {
+    if (name.size() < 2 || name.substr(name.size() - 2) != ".s") {
+        return Cipher::PLAIN;
+    }
+    return is_encrypted_name ? Cipher::ENCRYPTED_SCRIPT : Cipher::SCRIPT;
+}
+
+void CryptScalar(uint8_t *output, const uint8_t *input, size_t size, const uint8_t *key_stream) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t value;
+        uint64_t key;
+        memcpy(&value, input + i, sizeof(value));
+        memcpy(&key, key_stream + i % KEY_PERIOD, sizeof(key));
+        value ^= key;
+        memcpy(output + i, &value, sizeof(value));
+    }
+    for (; i < size; ++i) {
+        output[i] = input[i] ^ key_stream[i % KEY_PERIOD];
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+void CryptSse2(uint8_t *output, const uint8_t *input, size_t size, const uint8_t *key_stream) {
+    const size_t lanes = KEY_PERIOD / sizeof(__m128i);
+    __m128i keys[lanes];
+    for (size_t i = 0; i < lanes; ++i) {
+        keys[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(key_stream) + i);
+    }
+    size_t periods = size / KEY_PERIOD;
+    for (size_t period = 0; period < periods; ++period) {
+        auto period_input = reinterpret_cast<const __m128i *>(input + period * KEY_PERIOD);
+        auto period_output = reinterpret_cast<__m128i *>(output + period * KEY_PERIOD);
+        for (size_t i = 0; i < lanes; ++i) {
+            _mm_storeu_si128(period_output + i,
+                             _mm_xor_si128(_mm_loadu_si128(period_input + i), keys[i]));
+        }
+    }
+    size_t done = periods * KEY_PERIOD;
+    CryptScalar(output + done, input + done, size - done, key_stream);
+}
+
+__attribute__((target("avx2")))
+void CryptAvx2(uint8_t *output, const uint8_t *input, size_t size, const uint8_t *key_stream) {
+    const size_t lanes = KEY_PERIOD / sizeof(__m256i);
+    __m256i keys[lanes];
+    for (size_t i = 0; i < lanes; ++i) {
+        keys[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(key_stream) + i);
+    }
+    size_t periods = size / KEY_PERIOD;
+    for (size_t period = 0; period < periods; ++period) {
+        auto period_input = reinterpret_cast<const __m256i *>(input + period * KEY_PERIOD);
+        auto period_output = reinterpret_cast<__m256i *>(output + period * KEY_PERIOD);
+        for (size_t i = 0; i < lanes; ++i) {
+            _mm256_storeu_si256(period_output + i,
+                                _mm256_xor_si256(_mm256_loadu_si256(period_input + i), keys[i]));
+        }
+    }
+    size_t done = periods * KEY_PERIOD;
+    CryptScalar(output + done, input + done, size - done, key_stream);
+}
+
+__attribute__((target("avx512f")))
+void CryptAvx512(uint8_t *output, const uint8_t *input, size_t size, const uint8_t *key_stream) {
+    const size_t lanes = KEY_PERIOD / sizeof(__m512i);
+    __m512i keys[lanes];
+    for (size_t i = 0; i < lanes; ++i) {
+        keys[i] = _mm512_loadu_si512(key_stream + i * sizeof(__m512i));
+    }
+    size_t periods = size / KEY_PERIOD;
+    for (size_t period = 0; period < periods; ++period) {
+        const uint8_t *period_input = input + period * KEY_PERIOD;
+        uint8_t *period_output = output + period * KEY_PERIOD;
+        for (size_t i = 0; i < lanes; ++i) {
+            __m512i value = _mm512_loadu_si512(period_input + i * sizeof(__m512i));
+            _mm512_storeu_si512(period_output + i * sizeof(__m512i),
+                                _mm512_xor_si512(value, keys[i]));
+        }
+    }
+    size_t done = periods * KEY_PERIOD;
+    CryptScalar(output + done, input + done, size - done, key_stream);
+}
+
+#endif
+
+vector<pair<const char *, CryptFunction>> ListCryptFunctions() {
+    vector<pair<const char *, CryptFunction>> functions{ { "scalar", CryptScalar } };
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        functions.emplace_back("sse2", CryptSse2);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        functions.emplace_back("avx2", CryptAvx2);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        functions.emplace_back("avx512", CryptAvx512);
+    }
+#endif
+    return functions;
+}
+
+// The last of ListCryptFunctions(), without allocating during static initialization.
+CryptFunction SelectCryptFunction() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return CryptAvx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return CryptAvx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return CryptSse2;
+    }
+#endif
+    return CryptScalar;
+}
+
+const CryptFunction Crypt = SelectCryptFunction();
+
+void CheckEntryRange(const Entry &entry, size_t file_size) {
+    if (static_cast<size_t>(entry.offset) + entry.size > file_size) {
+        throw out_of_range("Entry offset: " + to_string(entry.offset) + ", size: "
+                           + to_string(entry.size) + ", file size: " + to_string(file_size));
+    }
+}
+
+void ParseArchive(const MappedFile &file, vector<Entry> &entries, string &names,
+                  const function<string_view(uint64_t key)> &find_name, ParseTimes *times) {
+    auto now = [times] {
+        return times != nullptr ? chrono::steady_clock::now() : chrono::steady_clock::time_point{};
+    };
+    auto elapsed = [](chrono::steady_clock::time_point begin, chrono::steady_clock::time_point end) {
+        return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(end - begin)
+                                             .count());
+    };
+    auto start = now();
+    const uint8_t *file_begin = file.data();
+    const uint8_t *file_end = file_begin + file.size();
+    size_t file_size = file.size();
+
+    const uint8_t *data = file_begin + IGA_ENTRIES_OFFSET;
+    uint32_t entries_length = ReadPackedUint32(data, file_end);
+    if (entries_length > static_cast<size_t>(file_end - data)) {
+        throw out_of_range("Entries length: " + to_string(entries_length) + ", file size: "
+                           + to_string(file_size));
+    }
+    entries = ReadEntries(data, data + entries_length);
+    auto entries_end = now();
+
+    uint32_t names_length = ReadPackedUint32(data, file_end);
+    if (names_length > static_cast<size_t>(file_end - data)) {
+        throw out_of_range("Names length: " + to_string(names_length) + ", file size: "
+                           + to_string(file_size));
+    }
+    const uint8_t *names_end = data + names_length;
+    size_t names_end_offset = names_end - file_begin;
+    ReadNames(data, names_end, entries, names);
+    if (times != nullptr) {
+        times->entries += elapsed(start, entries_end);
+        times->names += elapsed(entries_end, now());
+    }
+    for (auto &entry : entries) {
+        string_view name = entry.name;
+        uint64_t key;
+        if (PackEncryptedName(name, key)) {
+            entry.encrypted_name = name;
+            auto lookup_start = now();
+            string_view decrypted_name = find_name(key);
+            if (times != nullptr) {
+                times->name_lookups += elapsed(lookup_start, now());
+                ++times->name_lookup_count;
+            }
+            if (!decrypted_name.empty()) {
+                entry.name = decrypted_name;
+            }
+        }
+        entry.offset += names_end_offset;
+        CheckEntryRange(entry, file_size);
+    }
+}
+
+void CryptAt(uint8_t *output, const uint8_t *input, size_t size, uint64_t offset,
+             const uint8_t *key_stream) {
+    Crypt(output, input, size, key_stream + offset % KEY_PERIOD);
+}
+
+IgaArchive::IgaArchive(const string &path)
+    : IgaArchive{path, [](const MappedFile &file, vector<Entry> &entries, string &names) {
+          ParseArchive(file, entries, names, FindEncryptedName);
+      }} {}
+
+IgaArchive::IgaArchive(const string &path, const EntryLoader &load_entries) : file_{path} {
+    const uint8_t *signature = file_.data();
+    if (file_.size() < IGA_ENTRIES_OFFSET) {
+        throw out_of_range("File size: " + to_string(file_.size()));
+    }
+    if (!equal(signature, signature + sizeof(IGA_SIGNATURE), IGA_SIGNATURE)) {
+        throw runtime_error("Unexpected signature: " + path);
+    }
+    load_entries(file_, entries_, names_);
+    for (const auto &entry : entries_) {
+        CheckEntryRange(entry, file_.size());
+    }
+    entry_indices_.reserve(entries_.size());
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        entry_indices_[entries_[i].name] = i;
+    }
+    for (size_t i = 0; i < entries_.size(); ++i) {
+        if (!entries_[i].encrypted_name.empty()) {
+            entry_indices_.emplace(entries_[i].encrypted_name, i);
+        }
+    }
+}
+
+const Entry *IgaArchive::FindEntry(string_view name) const {
+    auto iter = entry_indices_.find(name);
+    if (iter == entry_indices_.end()) {
+        return nullptr;
+    }
+    return &entries_[iter->second];
+}
+
+void IgaArchive::DecryptInto(const Entry &entry, uint32_t offset, uint8_t *buffer,
+                             size_t size) const {
+    if (offset > entry.size || size > entry.size - offset) {
+        throw out_of_range("Entry offset: " + to_string(offset) + ", size: " + to_string(size)
+                           + ", entry size: " + to_string(entry.size));
+    }
+    CryptAt(buffer, GetData(entry) + offset, size, offset, GetKeyStream(entry.cipher()));
+}
+
+IgaReader::IgaReader(const IgaArchive &archive, const Entry &entry)
+    : data_(archive.GetData(entry)), size_(entry.size),
+      key_stream_(GetKeyStream(entry.cipher())) {}
+
+size_t IgaReader::Read(uint8_t *buffer, size_t size) {
+    size = min<size_t>(size, size_ - position_);
+    CryptAt(buffer, data_ + position_, size, position_, key_stream_);
+    position_ += static_cast<uint32_t>(size);
+    return size;
+}
+
+void IgaReader::Seek(uint32_t position) {
+    if (position > size_) {
+        throw out_of_range("Position: " + to_string(position) + ", entry size: "
+                           + to_string(size_));
+    }
+    position_ = position;
+}
@@ -0,0 +1,213 @@
+#ifndef IGA_H
+#define IGA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+/**
+ * The IGA format, shared by igatool and any other program that reads archives in-process.
+ *
+ * @see https://github.com/morkt/GARbro/blob/master/ArcFormats/Noesis/ArcIGA.cs
+ */
+
+#define KEY_PERIOD (UINT8_MAX + 1u)
+
+const uint8_t IGA_SIGNATURE[4] = { 'I', 'G', 'A', '0' };
+const uint8_t IGA_UNKNOWN[4] = { 0x00, 0x00, 0x00, 0x00 };
+const uint8_t IGA_PADDING[8] = { 0x02, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00 };
+const size_t IGA_ENTRIES_OFFSET = sizeof(IGA_SIGNATURE) + sizeof(IGA_UNKNOWN)
+        + sizeof(IGA_PADDING);
+
+// The key for byte i of an entry only depends on i % KEY_PERIOD, so the cipher is a XOR with a
+// repeating KEY_PERIOD-byte key stream, and any range of an entry can be decrypted on its own.
+enum class Cipher {
+    PLAIN,
+    SCRIPT,
+    ENCRYPTED_SCRIPT
+};
+
+Cipher GetCipher(std::string_view name, bool is_encrypted_name);
+
+// Returns the keys for offset 0 of an entry, followed by 2 * KEY_PERIOD - 1 more.
+const uint8_t *GetKeyStream(Cipher cipher);
+
+// The key stream points at the key for the first byte of input, with at least KEY_PERIOD - 1 more
+// keys after it. Input and output may be the same buffer.
+typedef void (*CryptFunction)(uint8_t *output, const uint8_t *input, size_t size,
+                              const uint8_t *key_stream);
+
+// The fastest implementation for the CPU, selected at startup.
+extern const CryptFunction Crypt;
+
+// Every implementation the CPU supports with its name, slowest first, so that they can be compared.
+std::vector<std::pair<const char *, CryptFunction>> ListCryptFunctions();
+
+// Encrypts or decrypts size bytes that start at offset in an entry, for any offset, with the key
+// stream from GetKeyStream().
+void CryptAt(uint8_t *output, const uint8_t *input, size_t size, uint64_t offset,
+             const uint8_t *key_stream);
+
+struct Entry {
+    uint32_t name_offset;
+    // Offset of the data in the archive file.
+    uint32_t offset;
+    uint32_t size;
+    // Views into the names arena of the archive, or into the encrypted names table.
+    std::string_view name;
+    std::string_view encrypted_name;
+
+    Cipher cipher() const {
+        return GetCipher(name, !encrypted_name.empty());
+    }
+};
+
+extern const uint64_t ENCRYPTED_NAMES_FINGERPRINT;
+
+bool PackEncryptedName(std::string_view encrypted_name, uint64_t &key);
+
+std::string_view FindEncryptedName(uint64_t key);
+
+// Returns the built-in names with their keys, in key order.
+std::vector<std::pair<uint64_t, std::string_view>> ListEncryptedNames();
+
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path);
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile();
+
+    const uint8_t *data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    const struct stat &status() const {
+        return status_;
+    }
+
+    void Advise(int advice) const;
+
+private:
+    struct stat status_{};
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+uint32_t ReadPackedUint32(const uint8_t *&data, const uint8_t *end);
+
+// Decodes one byte at a time, which ReadPackedUint32() falls back to near the end of the data.
+uint32_t ReadPackedUint32Slow(const uint8_t *&data, const uint8_t *end);
+
+std::vector<Entry> ReadEntries(const uint8_t *&data, const uint8_t *end);
+
+// The stop bit takes bit 0 of the last byte and the value is read through a uint32, so only 31 bits
+// survive a round trip.
+#define MAX_PACKED_UINT32 (UINT32_MAX >> 1u)
+
+void WritePackedUint32(std::ostream &stream, uint32_t value);
+
+void WritePackedString(std::ostream &stream, std::string_view value);
+
+void ReadNames(const uint8_t *&data, const uint8_t *end, std::vector<Entry> &entries,
+               std::string &names);
+
+// Where ParseArchive() spends its time, in nanoseconds.
+struct ParseTimes {
+    uint64_t entries = 0;
+    uint64_t names = 0;
+    uint64_t name_lookups = 0;
+    uint64_t name_lookup_count = 0;
+};
+
+// Parses the entry table and names of an archive whose signature was already checked. Entry names
+// point into names, or to what find_name(key) returns for an encrypted name unless it is empty.
+// The clock is only read if times isn't null.
+void ParseArchive(const MappedFile &file, std::vector<Entry> &entries, std::string &names,
+                  const std::function<std::string_view(uint64_t key)> &find_name,
+                  ParseTimes *times = nullptr);
+
+// Fills the entries of an archive whose signature was already checked, and names with the strings
+// they point into unless they point somewhere the caller keeps alive.
+typedef std::function<void(const MappedFile &file, std::vector<Entry> &entries,
+                           std::string &names)> EntryLoader;
+
+// An archive mapped into memory, whose entries are views that stay valid as long as it is open.
+class IgaArchive {
+public:
+    explicit IgaArchive(const std::string &path);
+
+    // Gets the entries from load_entries instead of parsing them with the built-in names, and
+    // still checks that their data lies within the file.
+    IgaArchive(const std::string &path, const EntryLoader &load_entries);
+
+    IgaArchive(const IgaArchive &) = delete;
+    IgaArchive &operator=(const IgaArchive &) = delete;
+
+    const MappedFile &file() const {
+        return file_;
+    }
+
+    const std::vector<Entry> &entries() const {
+        return entries_;
+    }
+
+    // Finds the last entry with the name, or else with the encrypted name, or returns null.
+    const Entry *FindEntry(std::string_view name) const;
+
+    // The encrypted data of the entry, straight from the mapping.
+    const uint8_t *GetData(const Entry &entry) const {
+        return file_.data() + entry.offset;
+    }
+
+    // Decrypts size bytes of the entry starting at offset into buffer.
+    void DecryptInto(const Entry &entry, uint32_t offset, uint8_t *buffer, size_t size) const;
+
+private:
+    MappedFile file_;
+    std::vector<Entry> entries_;
+    std::string names_;
+    std::unordered_map<std::string_view, size_t> entry_indices_;
+};
+
+// Reads an entry from the start, decrypting straight into the caller's buffers. The archive must
+// outlive the reader.
+class IgaReader {
+public:
+    IgaReader(const IgaArchive &archive, const Entry &entry);
+
+    // Decrypts up to size bytes into buffer and returns how many, or 0 at the end of the entry.
+    size_t Read(uint8_t *buffer, size_t size);
+
+    void Seek(uint32_t position);
+
+    uint32_t position() const {
+        return position_;
+    }
+
+    uint32_t size() const {
+        return size_;
+    }
+
+private:
+    const uint8_t *data_;
+    uint32_t size_;
+    const uint8_t *key_stream_;
+    uint32_t position_ = 0;
+};
+
+#endif
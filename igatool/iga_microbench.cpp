@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "iga.h"
+
+#define VALUE_COUNT (1u << 20)
+
+#define NAME_COUNT (1u << 16)
+
+#define ENTRY_COUNT 100000u
+
+#define CRYPT_BUFFER_SIZE (1024u * 1024)
+
+#define DEFAULT_MIN_TIME 0.5
+
+#define MIN_PASS_COUNT 5u
+
+using namespace std;
+
+// SplitMix64, so that inputs only depend on the seed and not on the standard library.
+class Random {
+public:
+    explicit Random(uint64_t seed) : state_(seed) {}
+
+    uint64_t Next() {
+        uint64_t value = (state_ += UINT64_C(0x9E3779B97F4A7C15));
+        value = (value ^ (value >> 30u)) * UINT64_C(0xBF58476D1CE4E5B9);
+        value = (value ^ (value >> 27u)) * UINT64_C(0x94D049BB133111EB);
+        return value ^ (value >> 31u);
+    }
+
+private:
+    uint64_t state_;
+};
+
+// Time stamp counter cycles, which tick at a constant rate regardless of frequency scaling, or 0
+// where there is no counter.
+uint64_t ReadCycles() {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Keeps the compiler from dropping the work of a pass.
+volatile uint64_t sink;
+
+struct BenchOptions {
+    uint64_t seed = 1;
+    double min_time = DEFAULT_MIN_TIME;
+    vector<string> filters;
+};
+
+// Runs pass() until min_time has passed, and reports its fastest run per byte of input. A pass
+// returns a value that depends on all of its work.
+void Measure(const BenchOptions &options, const string &name, size_t bytes,
+             const function<uint64_t()> &pass) {
+    if (!options.filters.empty() && none_of(options.filters.begin(), options.filters.end(),
+                                            [&](const string &filter) {
+        return name.find(filter) != string::npos;
+    })) {
+        return;
+    }
+    double best_seconds = INFINITY;
+    uint64_t best_cycles = UINT64_MAX;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < MIN_PASS_COUNT
+                       || chrono::duration<double>(chrono::steady_clock::now() - start).count()
+                          < options.min_time; ++i) {
+        auto pass_start = chrono::steady_clock::now();
+        uint64_t cycles_start = ReadCycles();
+        sink = sink + pass();
+        uint64_t cycles = ReadCycles() - cycles_start;
+        chrono::duration<double> duration = chrono::steady_clock::now() - pass_start;
+        best_seconds = min(best_seconds, duration.count());
+        best_cycles = min(best_cycles, cycles);
+    }
+    printf("%-40s %10zu %10.3f %12.3f %10.1f\n", name.c_str(), bytes, best_seconds * 1e9 / bytes,
+           static_cast<double>(best_cycles) / bytes, bytes / best_seconds / 1e6);
+    fflush(stdout);
+}
+
+// The istream reader igatool had before decoding from the mapping, one read() per byte.
+uint32_t ReadPackedUint32Istream(istream &stream) {
+    uint32_t value = 0;
+    while ((value & 1u) == 0) {
+        uint8_t byte;
+        stream.read(reinterpret_cast<char *>(&byte), sizeof(byte));
+        value = value << 7u | byte;
+    }
+    return value >> 1u;
+}
+
+string PackValues(const vector<uint32_t> &values) {
+    ostringstream stream{};
+    for (uint32_t value : values) {
+        WritePackedUint32(stream, value);
+    }
+    return stream.str();
+}
+
+void BenchPackedUint32(const BenchOptions &options) {
+    Random random{options.seed};
+    // Name characters take one or two bytes, offsets and sizes up to five.
+    vector<uint32_t> characters(VALUE_COUNT);
+    for (auto &character : characters) {
+        character = 0x20 + random.Next() % 0x5F;
+    }
+    vector<uint32_t> offsets(VALUE_COUNT);
+    for (auto &offset : offsets) {
+        offset = static_cast<uint32_t>(random.Next() >> (32 + random.Next() % 32));
+    }
+    for (const auto &[name, values] : { make_pair("characters", &characters),
+                                        make_pair("offsets", &offsets) }) {
+        string packed = PackValues(*values);
+        auto data = reinterpret_cast<const uint8_t *>(packed.data());
+        auto end = data + packed.size();
+        Measure(options, string{"packed_uint32/read/"} + name, packed.size(), [&] {
+            uint64_t sum = 0;
+            for (const uint8_t *iter = data; iter < end;) {
+                sum += ReadPackedUint32(iter, end);
+            }
+            return sum;
+        });
+        Measure(options, string{"packed_uint32/read_slow/"} + name, packed.size(), [&] {
+            uint64_t sum = 0;
+            for (const uint8_t *iter = data; iter < end;) {
+                sum += ReadPackedUint32Slow(iter, end);
+            }
+            return sum;
+        });
+        istringstream input_stream{};
+        Measure(options, string{"packed_uint32/read_istream/"} + name, packed.size(), [&] {
+            input_stream.str(packed);
+            uint64_t sum = 0;
+            for (size_t i = 0; i < values->size(); ++i) {
+                sum += ReadPackedUint32Istream(input_stream);
+            }
+            return sum;
+        });
+        ostringstream stream{};
+        Measure(options, string{"packed_uint32/write/"} + name, packed.size(), [&] {
+            stream.str({});
+            for (uint32_t value : *values) {
+                WritePackedUint32(stream, value);
+            }
+            return static_cast<uint64_t>(stream.tellp());
+        });
+    }
+}
+
+// An entry table like ReadEntries() decodes, with entry sizes spread log-uniformly between 256 B
+// and 256 KiB so that the archive stays under 4 GiB.
+void BenchEntries(const BenchOptions &options) {
+    Random random{options.seed};
+    vector<uint32_t> values{};
+    uint32_t name_offset = 0;
+    uint32_t offset = 0;
+    for (size_t i = 0; i < ENTRY_COUNT; ++i) {
+        double fraction = static_cast<double>(random.Next() >> 11u) * 0x1.0p-53;
+        auto size = static_cast<uint32_t>(256 * exp2(10 * fraction));
+        values.insert(values.end(), { name_offset, offset, size });
+        name_offset += 8 + random.Next() % 17;
+        offset += size;
+    }
+    string packed = PackValues(values);
+    auto data = reinterpret_cast<const uint8_t *>(packed.data());
+    Measure(options, "entries/read", packed.size(), [&] {
+        const uint8_t *iter = data;
+        return ReadEntries(iter, data + packed.size()).back().offset;
+    });
+    Measure(options, "entries/read_slow", packed.size(), [&] {
+        const uint8_t *iter = data;
+        const uint8_t *end = data + packed.size();
+        vector<Entry> entries(ENTRY_COUNT);
+        for (auto &entry : entries) {
+            entry.name_offset = ReadPackedUint32Slow(iter, end);
+            entry.offset = ReadPackedUint32Slow(iter, end);
+            entry.size = ReadPackedUint32Slow(iter, end);
+        }
+        return entries.back().offset;
+    });
+    istringstream input_stream{};
+    Measure(options, "entries/read_istream", packed.size(), [&] {
+        input_stream.str(packed);
+        vector<Entry> entries(ENTRY_COUNT);
+        for (auto &entry : entries) {
+            entry.name_offset = ReadPackedUint32Istream(input_stream);
+            entry.offset = ReadPackedUint32Istream(input_stream);
+            entry.size = ReadPackedUint32Istream(input_stream);
+        }
+        return entries.back().offset;
+    });
+}
+
+void BenchNames(const BenchOptions &options) {
+    Random random{options.seed};
+    const char characters[] = "abcdefghijklmnopqrstuvwxyz0123456789_.";
+    vector<Entry> entries(NAME_COUNT);
+    ostringstream names_stream{};
+    ostringstream quirk_names_stream{};
+    uint32_t name_offset = 0;
+    for (auto &entry : entries) {
+        entry.name_offset = name_offset;
+        size_t length = 8 + random.Next() % 17;
+        for (size_t i = 0; i < length; ++i) {
+            char c = characters[random.Next() % (sizeof(characters) - 1)];
+            WritePackedUint32(names_stream, static_cast<uint8_t>(c));
+            if ((c & 0x40) != 0) {
+                quirk_names_stream.put(0);
+            }
+            WritePackedUint32(quirk_names_stream, static_cast<uint8_t>(c));
+        }
+        name_offset += static_cast<uint32_t>(length);
+    }
+    // Shenghuixinglanxueyuan archives are only decoded until the end of the names, as if they had
+    // a single entry.
+    for (const auto &[name, packed, entry_count] : {
+            make_tuple("names/read", names_stream.str(), entries.size()),
+            make_tuple("names/read_quirk", quirk_names_stream.str(), size_t{1}) }) {
+        auto data = reinterpret_cast<const uint8_t *>(packed.data());
+        vector<Entry> pass_entries(entries.begin(), entries.begin() + entry_count);
+        string names{};
+        Measure(options, name, packed.size(), [&] {
+            const uint8_t *iter = data;
+            ReadNames(iter, data + packed.size(), pass_entries, names);
+            return names.size();
+        });
+    }
+}
+
+// The per-byte loop igatool had before the key stream tables, which computes every key from the
+// offset in the entry.
+void CryptByteLoop(uint8_t *output, const uint8_t *input, size_t size, uint64_t offset,
+                   Cipher cipher) {
+    for (size_t i = 0; i < size; ++i) {
+        uint8_t key = static_cast<uint8_t>(offset + i + 2);
+        if (cipher != Cipher::PLAIN) {
+            key ^= 0xFF;
+            if (cipher == Cipher::ENCRYPTED_SCRIPT) {
+                key ^= static_cast<uint8_t>(0x5C * (offset + i + 1));
+            }
+        }
+        output[i] = input[i] ^ key;
+    }
+}
+
+void BenchCrypt(const BenchOptions &options) {
+    Random random{options.seed};
+    vector<uint8_t> buffer(CRYPT_BUFFER_SIZE);
+    for (auto &byte : buffer) {
+        byte = static_cast<uint8_t>(random.Next());
+    }
+    const uint8_t *key_stream = GetKeyStream(Cipher::ENCRYPTED_SCRIPT);
+    // Small calls are dominated by the remainder and call overhead, like extracting tiny scripts.
+    for (size_t call_size : { size_t{64}, size_t{4096}, size_t{CRYPT_BUFFER_SIZE} }) {
+        Measure(options, "crypt/byte_loop/" + to_string(call_size), buffer.size(), [&] {
+            for (size_t offset = 0; offset < buffer.size(); offset += call_size) {
+                CryptByteLoop(buffer.data() + offset, buffer.data() + offset, call_size, offset,
+                              Cipher::ENCRYPTED_SCRIPT);
+            }
+            return buffer[random.Next() % buffer.size()];
+        });
+        for (const auto &[name, crypt] : ListCryptFunctions()) {
+            Measure(options, "crypt/" + string{name} + "/" + to_string(call_size), buffer.size(),
+                    [&] {
+                for (size_t offset = 0; offset < buffer.size(); offset += call_size) {
+                    crypt(buffer.data() + offset, buffer.data() + offset, call_size,
+                          key_stream + offset % KEY_PERIOD);
+                }
+                return buffer[random.Next() % buffer.size()];
+            });
+        }
+    }
+}
+
+string FormatEncryptedName(uint64_t key) {
+    string encrypted_name(12, '0');
+    for (size_t i = encrypted_name.size(); i-- > 0; key /= 36) {
+        uint64_t digit = key % 36;
+        encrypted_name[i] = static_cast<char>(digit < 10 ? '0' + digit : 'a' + digit - 10);
+    }
+    return encrypted_name;
+}
+
+void BenchEncryptedNames(const BenchOptions &options) {
+    Random random{options.seed};
+    vector<uint64_t> hit_keys{};
+    for (const auto &[key, name] : ListEncryptedNames()) {
+        hit_keys.push_back(key);
+    }
+    for (size_t i = hit_keys.size(); i > 1; --i) {
+        swap(hit_keys[i - 1], hit_keys[random.Next() % i]);
+    }
+    // 36^12, the number of encrypted names.
+    const uint64_t key_count = UINT64_C(4738381338321616896);
+    vector<uint64_t> miss_keys(hit_keys.size());
+    for (auto &key : miss_keys) {
+        key = random.Next() % key_count;
+    }
+    vector<string> encrypted_names{};
+    for (uint64_t key : hit_keys) {
+        encrypted_names.push_back(FormatEncryptedName(key));
+    }
+    // Reported per byte of the 12-character encrypted names.
+    size_t bytes = hit_keys.size() * 12;
+    Measure(options, "encrypted_names/pack", bytes, [&] {
+        uint64_t sum = 0;
+        for (const auto &encrypted_name : encrypted_names) {
+            uint64_t key;
+            sum += PackEncryptedName(encrypted_name, key) ? key : 0;
+        }
+        return sum;
+    });
+    for (const auto &[name, keys] : { make_pair("encrypted_names/find_hit", &hit_keys),
+                                      make_pair("encrypted_names/find_miss", &miss_keys) }) {
+        Measure(options, name, bytes, [&] {
+            uint64_t sum = 0;
+            for (uint64_t key : *keys) {
+                sum += FindEncryptedName(key).size();
+            }
+            return sum;
+        });
+    }
+    // The unordered_map from encrypted names to names that igatool had before the perfect hash,
+    // looked up by the encrypted name itself.
+    unordered_map<string, string> name_map{};
+    for (const auto &[key, name] : ListEncryptedNames()) {
+        name_map.emplace(FormatEncryptedName(key), name);
+    }
+    vector<string> miss_names{};
+    for (uint64_t key : miss_keys) {
+        miss_names.push_back(FormatEncryptedName(key));
+    }
+    for (const auto &[name, names] : {
+            make_pair("encrypted_names/find_hit_unordered_map", &encrypted_names),
+            make_pair("encrypted_names/find_miss_unordered_map", &miss_names) }) {
+        Measure(options, name, bytes, [&] {
+            uint64_t sum = 0;
+            for (const auto &encrypted_name : *names) {
+                auto iter = name_map.find(encrypted_name);
+                sum += iter != name_map.end() ? iter->second.size() : 0;
+            }
+            return sum;
+        });
+    }
+}
+
+void Usage(const string &program_name) {
+    cerr << "Usage: " << program_name << " [--seed SEED] [--min-time SECONDS] [FILTER...]"
+         << endl;
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options{};
+    int argi = 1;
+    for (; argi + 1 < argc; argi += 2) {
+        string option{argv[argi]};
+        char *end;
+        if (option == "--seed") {
+            options.seed = strtoull(argv[argi + 1], &end, 10);
+        } else if (option == "--min-time") {
+            options.min_time = strtod(argv[argi + 1], &end);
+        } else {
+            break;
+        }
+        if (*end != '\0') {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+    for (; argi < argc; ++argi) {
+        if (argv[argi][0] == '-') {
+            Usage(argv[0]);
+            return 1;
+        }
+        options.filters.emplace_back(argv[argi]);
+    }
+
+    printf("%-40s %10s %10s %12s %10s\n", "BENCHMARK", "BYTES", "NS/BYTE", "CYCLES/BYTE", "MB/S");
+    BenchPackedUint32(options);
+    BenchEntries(options);
+    BenchNames(options);
+    BenchCrypt(options);
+    BenchEncryptedNames(options);
+    return 0;
+}
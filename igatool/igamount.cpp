@@ -0,0 +1,267 @@
+#define FUSE_USE_VERSION 31
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <fuse.h>
+#include <sys/stat.h>
+
+#include "iga.h"
+
+using namespace std;
+
+#define CACHE_BLOCK_SIZE (64u * 1024)
+
+#define DEFAULT_CACHE_SIZE (64u * 1024 * 1024)
+
+// A least recently used cache of decrypted entry blocks, shared by all FUSE threads.
+class BlockCache {
+public:
+    explicit BlockCache(size_t size) : block_count_(size / CACHE_BLOCK_SIZE) {}
+
+    BlockCache(const BlockCache &) = delete;
+    BlockCache &operator=(const BlockCache &) = delete;
+
+    // Copies size bytes of the entry from offset into buffer, decrypting blocks that aren't
+    // cached.
+    void Read(const IgaArchive &archive, size_t index, uint32_t offset, uint8_t *buffer,
+              size_t size) {
+        const Entry &entry = archive.entries()[index];
+        if (block_count_ == 0) {
+            archive.DecryptInto(entry, offset, buffer, size);
+            return;
+        }
+        while (size > 0) {
+            uint32_t block_offset = offset / CACHE_BLOCK_SIZE * CACHE_BLOCK_SIZE;
+            uint64_t key = static_cast<uint64_t>(index) << 32u | block_offset / CACHE_BLOCK_SIZE;
+            size_t copy_offset = offset - block_offset;
+            size_t copy_size = min<size_t>(size, CACHE_BLOCK_SIZE - copy_offset);
+            if (!ReadCached(key, copy_offset, buffer, copy_size)) {
+                vector<uint8_t> data(min(CACHE_BLOCK_SIZE, entry.size - block_offset));
+                archive.DecryptInto(entry, block_offset, data.data(), data.size());
+                memcpy(buffer, data.data() + copy_offset, copy_size);
+                Insert(key, move(data));
+            }
+            offset += static_cast<uint32_t>(copy_size);
+            buffer += copy_size;
+            size -= copy_size;
+        }
+    }
+
+private:
+    struct Block {
+        uint64_t key;
+        vector<uint8_t> data;
+    };
+
+    bool ReadCached(uint64_t key, size_t offset, uint8_t *buffer, size_t size) {
+        lock_guard<mutex> lock{mutex_};
+        auto iter = block_iters_.find(key);
+        if (iter == block_iters_.end()) {
+            return false;
+        }
+        blocks_.splice(blocks_.begin(), blocks_, iter->second);
+        memcpy(buffer, iter->second->data.data() + offset, size);
+        return true;
+    }
+
+    void Insert(uint64_t key, vector<uint8_t> data) {
+        lock_guard<mutex> lock{mutex_};
+        // Another thread may have decrypted the same block meanwhile.
+        if (block_iters_.count(key) != 0) {
+            return;
+        }
+        blocks_.push_front(Block{key, move(data)});
+        block_iters_[key] = blocks_.begin();
+        if (blocks_.size() > block_count_) {
+            block_iters_.erase(blocks_.back().key);
+            blocks_.pop_back();
+        }
+    }
+
+    size_t block_count_;
+    mutex mutex_;
+    list<Block> blocks_;
+    unordered_map<uint64_t, list<Block>::iterator> block_iters_;
+};
+
+struct Mount {
+    Mount(const string &path, size_t cache_size) : archive{path}, cache{cache_size} {}
+
+    IgaArchive archive;
+    BlockCache cache;
+};
+
+Mount &GetMount() {
+    return *static_cast<Mount *>(fuse_get_context()->private_data);
+}
+
+// Entries are all at the top level, and a name maps to the last entry with it.
+const Entry *FindPathEntry(const char *path) {
+    if (path[0] != '/' || path[1] == '\0') {
+        return nullptr;
+    }
+    return GetMount().archive.FindEntry(path + 1);
+}
+
+void *MountInit(fuse_conn_info *, fuse_config *config) {
+    // The archive never changes under the mount, so the kernel may keep everything it has read.
+    config->kernel_cache = 1;
+    config->entry_timeout = 3600;
+    config->attr_timeout = 3600;
+    config->negative_timeout = 3600;
+    return fuse_get_context()->private_data;
+}
+
+int MountGetAttr(const char *path, struct stat *status, fuse_file_info *) {
+    const struct stat &archive_status = GetMount().archive.file().status();
+    memset(status, 0, sizeof(*status));
+    status->st_uid = archive_status.st_uid;
+    status->st_gid = archive_status.st_gid;
+    status->st_atim = archive_status.st_atim;
+    status->st_mtim = archive_status.st_mtim;
+    status->st_ctim = archive_status.st_ctim;
+    if (strcmp(path, "/") == 0) {
+        status->st_mode = S_IFDIR | 0555;
+        status->st_nlink = 2;
+        return 0;
+    }
+    const Entry *entry = FindPathEntry(path);
+    if (entry == nullptr) {
+        return -ENOENT;
+    }
+    status->st_mode = S_IFREG | 0444;
+    status->st_nlink = 1;
+    status->st_size = entry->size;
+    status->st_blocks = (entry->size + 511) / 512;
+    return 0;
+}
+
+int MountReadDir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t, fuse_file_info *,
+                 fuse_readdir_flags) {
+    if (strcmp(path, "/") != 0) {
+        return -ENOENT;
+    }
+    filler(buffer, ".", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+    filler(buffer, "..", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+    const IgaArchive &archive = GetMount().archive;
+    for (const auto &entry : archive.entries()) {
+        if (archive.FindEntry(entry.name) != &entry) {
+            continue;
+        }
+        filler(buffer, string{entry.name}.c_str(), nullptr, 0,
+               static_cast<fuse_fill_dir_flags>(0));
+    }
+    return 0;
+}
+
+int MountOpen(const char *path, fuse_file_info *file_info) {
+    const Entry *entry = FindPathEntry(path);
+    if (entry == nullptr) {
+        return -ENOENT;
+    }
+    if ((file_info->flags & O_ACCMODE) != O_RDONLY) {
+        return -EROFS;
+    }
+    file_info->fh = entry - GetMount().archive.entries().data();
+    file_info->keep_cache = 1;
+    return 0;
+}
+
+int MountRead(const char *, char *buffer, size_t size, off_t offset, fuse_file_info *file_info) {
+    Mount &mount = GetMount();
+    const Entry &entry = mount.archive.entries()[file_info->fh];
+    if (offset < 0) {
+        return -EINVAL;
+    }
+    if (static_cast<uint64_t>(offset) >= entry.size) {
+        return 0;
+    }
+    size = min<size_t>(size, entry.size - offset);
+    mount.cache.Read(mount.archive, file_info->fh, static_cast<uint32_t>(offset),
+                     reinterpret_cast<uint8_t *>(buffer), size);
+    return static_cast<int>(size);
+}
+
+void Usage(const string &program_name) {
+    cerr << "Usage: " << program_name
+         << " [--cache-size SIZE] IGA_FILE MOUNTPOINT [FUSE_OPTION...]" << endl;
+}
+
+// Parses a size in bytes with an optional K or M suffix.
+bool ParseSize(const string &value, size_t &size) {
+    size_t digits_end = value.find_first_not_of("0123456789");
+    if (digits_end == 0 || value.empty()) {
+        return false;
+    }
+    try {
+        size = stoul(value.substr(0, digits_end));
+    } catch (const out_of_range &) {
+        return false;
+    }
+    string suffix = value.substr(min(digits_end, value.size()));
+    size_t multiplier = 1;
+    if (suffix == "K" || suffix == "k") {
+        multiplier = 1024;
+    } else if (suffix == "M" || suffix == "m") {
+        multiplier = 1024 * 1024;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    if (size > SIZE_MAX / multiplier) {
+        return false;
+    }
+    size *= multiplier;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    size_t cache_size = DEFAULT_CACHE_SIZE;
+    int argi = 1;
+    if (argi + 1 < argc && string{argv[argi]} == "--cache-size") {
+        if (!ParseSize(argv[argi + 1], cache_size)) {
+            Usage(argv[0]);
+            return 1;
+        }
+        argi += 2;
+    }
+    if (argc - argi < 2) {
+        Usage(argv[0]);
+        return 1;
+    }
+    unique_ptr<Mount> mount;
+    try {
+        mount = make_unique<Mount>(argv[argi], cache_size);
+    } catch (const exception &e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    // FUSE gets the mount point and the remaining options, and always mounts read-only.
+    vector<char *> fuse_arguments{argv[0], argv[argi + 1]};
+    fuse_arguments.insert(fuse_arguments.end(), argv + argi + 2, argv + argc);
+    char read_only[] = "-oro";
+    fuse_arguments.push_back(read_only);
+    fuse_arguments.push_back(nullptr);
+
+    fuse_operations operations{};
+    operations.init = MountInit;
+    operations.getattr = MountGetAttr;
+    operations.readdir = MountReadDir;
+    operations.open = MountOpen;
+    operations.read = MountRead;
+    return fuse_main(static_cast<int>(fuse_arguments.size() - 1), fuse_arguments.data(),
+                     &operations, mount.get());
+}
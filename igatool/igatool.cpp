@@ -1,361 +1,3596 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cerrno>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
-/**
- * @see https://github.com/morkt/GARbro/blob/master/ArcFormats/Noesis/ArcIGA.cs
- */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define HAVE_IO_URING
+#endif
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "iga.h"
+
+using namespace std;
+
+#ifdef _WIN32
+#define SEPARATOR '\\'
+#else
+#define SEPARATOR '/'
+#endif
+
+#define BUFFER_SIZE 4096u
+
+#define CHUNK_SIZE (8u * 1024 * 1024)
+
+#define DEFAULT_WRITE_SIZE (1024u * 1024)
+
+#define MIN_ALLOCATE_SIZE (1024u * 1024)
+
+#define MIN_WRITE_SIZE BUFFER_SIZE
+
+#define MAX_WRITE_SIZE (64u * 1024 * 1024)
+
+#define MAX_BATCH_ENTRIES 64u
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+
+bool string_ends_with(string_view str, string_view suffix) {
+    return str.size() >= suffix.size()
+           && str.compare(str.size()-suffix.size(), suffix.size(), suffix) == 0;
+}
+
+char ToLowerAscii(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+string_view GetFileName(string_view path) {
+    size_t last_separator_index = path.find_last_of(SEPARATOR);
+    if (last_separator_index == path.size() - 1) {
+        throw invalid_argument(string{path});
+    } else if (last_separator_index != string_view::npos) {
+        return path.substr(last_separator_index + 1);
+    } else {
+        return path;
+    }
+}
+
+// What --stats reports. Times are in nanoseconds, and those spent on entries are summed over the
+// workers, so with -j they add up to more than the elapsed time.
+enum class StatsTime {
+    HEADER_PARSE,
+    NAME_DECODE,
+    NAME_LOOKUP,
+    INDEX_LOAD,
+    ENTRY_CHECK,
+    ENTRY_OPEN,
+    ENTRY_DECRYPT,
+    ENTRY_WRITE,
+    COUNT
+};
+
+const char *const STATS_TIME_NAMES[] = { "header_parse", "name_decode", "name_lookup",
+                                         "index_load", "entry_check", "entry_open",
+                                         "entry_decrypt", "entry_write" };
+
+// System calls are only those igatool issues itself, and MMAP counts files mapped with open(),
+// fstat(), mmap() and close().
+enum class StatsCount {
+    ARCHIVE_ENTRIES,
+    ENTRIES,
+    NAME_LOOKUPS,
+    BYTES_DECRYPTED,
+    BYTES_WRITTEN,
+    OPEN,
+    CLOSE,
+    MMAP,
+    STAT,
+    FTRUNCATE,
+    FALLOCATE,
+    PWRITE,
+    WRITE,
+    IO_URING_ENTER,
+    COUNT
+};
+
+const char *const STATS_COUNT_NAMES[] = { "archive_entries", "entries", "name_lookups",
+                                          "bytes_decrypted", "bytes_written", "open", "close",
+                                          "mmap", "stat", "ftruncate", "fallocate", "pwrite",
+                                          "write", "io_uring_enter" };
+
+#define FIRST_SYSCALL_STATS_COUNT StatsCount::OPEN
+
+struct Stats {
+    bool enabled = false;
+    string command;
+    size_t jobs = 0;
+    chrono::steady_clock::time_point start;
+    atomic<uint64_t> times[static_cast<size_t>(StatsTime::COUNT)];
+    atomic<uint64_t> counts[static_cast<size_t>(StatsCount::COUNT)];
+};
+
+Stats stats{};
+
+void AddStatsTime(StatsTime time, uint64_t nanoseconds) {
+    if (stats.enabled) {
+        stats.times[static_cast<size_t>(time)].fetch_add(nanoseconds, memory_order_relaxed);
+    }
+}
+
+void AddStatsCount(StatsCount count, uint64_t value = 1) {
+    if (stats.enabled) {
+        stats.counts[static_cast<size_t>(count)].fetch_add(value, memory_order_relaxed);
+    }
+}
+
+void AppendJsonString(ostream &stream, string_view value) {
+    stream << '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            stream << '\\' << c;
+        } else if (static_cast<uint8_t>(c) < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            stream << escape;
+        } else {
+            stream << c;
+        }
+    }
+    stream << '"';
+}
+
+string GetJsonString(string_view value) {
+    ostringstream stream{};
+    AppendJsonString(stream, value);
+    return stream.str();
+}
+
+// A span for --trace: 'X' is a span of work on its thread, and 'b' is an asynchronous one, like a
+// write in flight, which may overlap others.
+struct TraceEvent {
+    const char *name;
+    char phase;
+    uint64_t id;
+    chrono::steady_clock::time_point start;
+    chrono::steady_clock::time_point end;
+    // The members of the JSON args object, if any.
+    string args;
+};
+
+struct TraceThread {
+    size_t id;
+    string name;
+    vector<TraceEvent> events;
+};
+
+// Each thread records its spans without locking, and they are all written out in the Chrome trace
+// event format at exit, once the threads are done.
+struct Trace {
+    bool enabled = false;
+    string path;
+    chrono::steady_clock::time_point start;
+    mutex threads_mutex;
+    deque<TraceThread> threads;
+    atomic<uint64_t> next_id;
+};
+
+Trace trace{};
+
+TraceThread &GetTraceThread() {
+    thread_local TraceThread *thread = nullptr;
+    if (thread == nullptr) {
+        lock_guard<mutex> lock{trace.threads_mutex};
+        thread = &trace.threads.emplace_back();
+        thread->id = trace.threads.size();
+    }
+    return *thread;
+}
+
+void SetTraceThreadName(const string &name) {
+    if (trace.enabled) {
+        GetTraceThread().name = name;
+    }
+}
+
+void AddTraceEvent(TraceEvent event) {
+    if (trace.enabled) {
+        GetTraceThread().events.push_back(move(event));
+    }
+}
+
+// Records a span on the current thread from construction until it goes out of scope, if --trace is
+// enabled.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name, string args = {}) : is_enabled_(trace.enabled) {
+        if (is_enabled_) {
+            event_.name = name;
+            event_.phase = 'X';
+            event_.args = move(args);
+            event_.start = chrono::steady_clock::now();
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    ~TraceSpan() {
+        if (is_enabled_) {
+            event_.end = chrono::steady_clock::now();
+            AddTraceEvent(move(event_));
+        }
+    }
+
+private:
+    bool is_enabled_;
+    TraceEvent event_{};
+};
+
+// Adds the time until it goes out of scope to --stats, and records it as a span for --trace, only
+// reading the clock if either is enabled.
+class StatsTimer {
+public:
+    explicit StatsTimer(StatsTime time) : time_(time), is_enabled_(stats.enabled || trace.enabled) {
+        if (is_enabled_) {
+            start_ = chrono::steady_clock::now();
+        }
+    }
+
+    StatsTimer(const StatsTimer &) = delete;
+    StatsTimer &operator=(const StatsTimer &) = delete;
+
+    ~StatsTimer() {
+        if (is_enabled_) {
+            auto end = chrono::steady_clock::now();
+            AddStatsTime(time_, chrono::duration_cast<chrono::nanoseconds>(end - start_).count());
+            AddTraceEvent({ STATS_TIME_NAMES[static_cast<size_t>(time_)], 'X', 0, start_, end, {} });
+        }
+    }
+
+private:
+    StatsTime time_;
+    bool is_enabled_;
+    chrono::steady_clock::time_point start_;
+};
+
+class OutputFile {
+public:
+    explicit OutputFile(const string &path, bool truncate = true) : path_(path) {
+        StatsTimer timer{StatsTime::ENTRY_OPEN};
+        AddStatsCount(StatsCount::OPEN);
+        fd_ = open(path.c_str(), O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0) | O_CLOEXEC, 0666);
+        if (fd_ == -1) {
+            throw system_error(errno, generic_category(), path);
+        }
+    }
+
+    OutputFile(const OutputFile &) = delete;
+    OutputFile &operator=(const OutputFile &) = delete;
+
+    ~OutputFile() {
+        AddStatsCount(StatsCount::CLOSE);
+        close(fd_);
+    }
+
+    void Truncate(size_t size) {
+        StatsTimer timer{StatsTime::ENTRY_OPEN};
+        AddStatsCount(StatsCount::FTRUNCATE);
+        if (ftruncate(fd_, static_cast<off_t>(size)) == -1) {
+            throw system_error(errno, generic_category(), path_);
+        }
+    }
+
+    // Allocates size bytes of the file from offset up front, so that it isn't grown and
+    // fragmented write by write. Small files are written in one go anyway, and allocating them
+    // separately only costs a system call.
+    void Allocate(size_t size, size_t offset = 0) {
+#ifdef __linux__
+        if (size < MIN_ALLOCATE_SIZE) {
+            return;
+        }
+        StatsTimer timer{StatsTime::ENTRY_OPEN};
+        AddStatsCount(StatsCount::FALLOCATE);
+        if (fallocate(fd_, 0, static_cast<off_t>(offset), static_cast<off_t>(size)) == -1
+            && errno != EOPNOTSUPP
+            && errno != ENOSYS) {
+            throw system_error(errno, generic_category(), path_);
+        }
+#endif
+    }
+
+    int fd() const {
+        return fd_;
+    }
+
+    const string &path() const {
+        return path_;
+    }
+
+    void Write(const uint8_t *data, size_t size, size_t offset) {
+        while (size > 0) {
+            AddStatsCount(StatsCount::PWRITE);
+            ssize_t written = pwrite(fd_, data, size, static_cast<off_t>(offset));
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw system_error(errno, generic_category(), path_);
+            }
+            AddStatsCount(StatsCount::BYTES_WRITTEN, written);
+            data += written;
+            size -= written;
+            offset += written;
+        }
+    }
+
+private:
+    string path_;
+    int fd_;
+};
+
+// Each worker owns a deque that it pops from the back, and steals from the front of the other
+// workers' deques once its own runs dry.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t thread_count) : queues_(thread_count) {
+        for (size_t i = 0; i < thread_count; ++i) {
+            threads_.emplace_back([this, i] { Run(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock{mutex_};
+            stopping_ = true;
+        }
+        condition_.notify_all();
+        for (auto &thread : threads_) {
+            thread.join();
+        }
+    }
+
+    void Submit(function<void()> task) {
+        Queue &queue = queues_[next_queue_++ % queues_.size()];
+        {
+            lock_guard<mutex> lock{queue.tasks_mutex};
+            queue.tasks.push_back(move(task));
+        }
+        {
+            lock_guard<mutex> lock{mutex_};
+            ++queued_;
+            ++pending_;
+        }
+        condition_.notify_one();
+    }
+
+    // Waits for all submitted tasks to finish, and rethrows the first exception thrown by them.
+    void Wait() {
+        unique_lock<mutex> lock{mutex_};
+        idle_condition_.wait(lock, [this] { return pending_ == 0; });
+        if (exception_) {
+            rethrow_exception(exchange(exception_, nullptr));
+        }
+    }
+
+private:
+    struct Queue {
+        mutex tasks_mutex;
+        deque<function<void()>> tasks;
+    };
+
+    bool TryPop(size_t index, function<void()> &task) {
+        for (size_t i = 0; i < queues_.size(); ++i) {
+            Queue &queue = queues_[(index + i) % queues_.size()];
+            lock_guard<mutex> lock{queue.tasks_mutex};
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void Run(size_t index) {
+        SetTraceThreadName("worker " + to_string(index));
+        while (true) {
+            {
+                unique_lock<mutex> lock{mutex_};
+                condition_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+                if (queued_ == 0) {
+                    return;
+                }
+                // Reserves one of the queued tasks, which will be in some queue until we take it.
+                --queued_;
+            }
+            function<void()> task;
+            while (!TryPop(index, task)) {
+                this_thread::yield();
+            }
+            try {
+                task();
+            } catch (...) {
+                lock_guard<mutex> lock{mutex_};
+                if (!exception_) {
+                    exception_ = current_exception();
+                }
+            }
+            task = nullptr;
+            {
+                lock_guard<mutex> lock{mutex_};
+                if (--pending_ == 0) {
+                    idle_condition_.notify_all();
+                }
+            }
+        }
+    }
+
+    vector<Queue> queues_;
+    vector<thread> threads_;
+    atomic<size_t> next_queue_{0};
+    mutex mutex_;
+    condition_variable condition_;
+    condition_variable idle_condition_;
+    size_t queued_ = 0;
+    size_t pending_ = 0;
+    bool stopping_ = false;
+    exception_ptr exception_;
+};
+
+#ifdef HAVE_IO_URING
+
+// Writes output files through io_uring, so that many writes stay in flight while the workers keep
+// decrypting. Workers decrypt into buffers from a pool registered with the ring, and a reaper
+// thread recycles each buffer once its write completes.
+class UringWriter {
+public:
+    // Returns null if io_uring is not available.
+    static unique_ptr<UringWriter> Create(size_t buffer_count, size_t buffer_size) {
+        unique_ptr<UringWriter> writer{new UringWriter(buffer_count, buffer_size)};
+        if (!writer->Setup()) {
+            return nullptr;
+        }
+        writer->reaper_ = thread([writer = writer.get()] { writer->Reap(); });
+        return writer;
+    }
+
+    UringWriter(const UringWriter &) = delete;
+    UringWriter &operator=(const UringWriter &) = delete;
+
+    ~UringWriter() {
+        if (reaper_.joinable()) {
+            // Buffers must outlive the writes in flight, even if they are not waited for. Nothing
+            // completes anymore once the reaper has failed, and it has already returned.
+            bool is_reaping;
+            {
+                unique_lock<mutex> lock{mutex_};
+                condition_.wait(lock, [this] { return in_flight_ == 0 || reaper_failed_; });
+                is_reaping = !reaper_failed_;
+            }
+            if (is_reaping) {
+                lock_guard<mutex> lock{submit_mutex_};
+                io_uring_sqe &sqe = NextSqe();
+                sqe.opcode = IORING_OP_NOP;
+                sqe.user_data = STOP_USER_DATA;
+                Submit();
+            }
+            reaper_.join();
+        }
+        if (sq_ring_ != MAP_FAILED) {
+            munmap(sq_ring_, sq_ring_size_);
+        }
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        if (sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqes_size_);
+        }
+        if (ring_fd_ != -1) {
+            close(ring_fd_);
+        }
+        free(buffers_);
+    }
+
+    size_t buffer_size() const {
+        return buffer_size_;
+    }
+
+    // Waits for a free buffer, which is owned by the caller until it is passed to Write().
+    uint8_t *AcquireBuffer(size_t &index) {
+        unique_lock<mutex> lock{mutex_};
+        condition_.wait(lock, [this] { return !free_buffers_.empty() || reaper_failed_; });
+        if (reaper_failed_) {
+            rethrow_exception(exception_);
+        }
+        index = free_buffers_.back();
+        free_buffers_.pop_back();
+        return buffers_ + index * buffer_size_;
+    }
+
+    // Writes size bytes from an acquired buffer, keeping the file open until the write completes.
+    void Write(const shared_ptr<OutputFile> &file, size_t buffer_index, size_t size,
+               size_t offset) {
+        {
+            lock_guard<mutex> lock{mutex_};
+            if (reaper_failed_) {
+                rethrow_exception(exception_);
+            }
+            requests_[buffer_index] = { file, size, offset,
+                                        trace.enabled ? chrono::steady_clock::now()
+                                                      : chrono::steady_clock::time_point{} };
+            ++in_flight_;
+        }
+        lock_guard<mutex> lock{submit_mutex_};
+        io_uring_sqe &sqe = NextSqe();
+        sqe.opcode = is_registered_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe.fd = file->fd();
+        sqe.addr = reinterpret_cast<uintptr_t>(buffers_ + buffer_index * buffer_size_);
+        sqe.len = static_cast<uint32_t>(size);
+        sqe.off = offset;
+        sqe.buf_index = static_cast<uint16_t>(buffer_index);
+        sqe.user_data = buffer_index;
+        Submit();
+    }
+
+    // Waits for all writes to complete, and rethrows the first error of them or of the reaper.
+    void Wait() {
+        unique_lock<mutex> lock{mutex_};
+        condition_.wait(lock, [this] { return in_flight_ == 0 || reaper_failed_; });
+        if (reaper_failed_) {
+            lock.unlock();
+            if (reaper_.joinable()) {
+                reaper_.join();
+            }
+            rethrow_exception(exception_);
+        }
+        if (exception_) {
+            rethrow_exception(exchange(exception_, nullptr));
+        }
+    }
+
+private:
+    static constexpr uint64_t STOP_USER_DATA = UINT64_MAX;
+
+    struct Request {
+        shared_ptr<OutputFile> file;
+        size_t size;
+        size_t offset;
+        chrono::steady_clock::time_point start;
+    };
+
+    UringWriter(size_t buffer_count, size_t buffer_size)
+        : buffer_count_(buffer_count), buffer_size_(buffer_size), requests_(buffer_count) {}
+
+    bool Setup() {
+        buffers_ = static_cast<uint8_t *>(aligned_alloc(4096, buffer_count_ * buffer_size_));
+        if (buffers_ == nullptr) {
+            return false;
+        }
+        for (size_t i = buffer_count_; i-- > 0;) {
+            free_buffers_.push_back(i);
+        }
+        // One more entry for the stop request.
+        io_uring_params params{};
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, buffer_count_ + 1, &params));
+        if (ring_fd_ == -1 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            return false;
+        }
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sq_ring_size_ = cq_ring_size_ = max(sq_ring_size_, cq_ring_size_);
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            return false;
+        }
+        cq_ring_ = sq_ring_;
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd_, IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) {
+            return false;
+        }
+        auto sq_ring = static_cast<uint8_t *>(sq_ring_);
+        sq_tail_ = reinterpret_cast<uint32_t *>(sq_ring + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<uint32_t *>(sq_ring + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<uint32_t *>(sq_ring + params.sq_off.array);
+        auto cq_ring = static_cast<uint8_t *>(cq_ring_);
+        cq_head_ = reinterpret_cast<uint32_t *>(cq_ring + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<uint32_t *>(cq_ring + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<uint32_t *>(cq_ring + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq_ring + params.cq_off.cqes);
+
+        // Registered buffers save mapping them for every write, but may exceed RLIMIT_MEMLOCK.
+        vector<iovec> iovecs(buffer_count_);
+        for (size_t i = 0; i < buffer_count_; ++i) {
+            iovecs[i].iov_base = buffers_ + i * buffer_size_;
+            iovecs[i].iov_len = buffer_size_;
+        }
+        is_registered_ = syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS,
+                                 iovecs.data(), iovecs.size()) == 0;
+        return true;
+    }
+
+    io_uring_sqe &NextSqe() {
+        uint32_t tail = *sq_tail_;
+        uint32_t index = tail & sq_mask_;
+        io_uring_sqe &sqe = static_cast<io_uring_sqe *>(sqes_)[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sq_array_[index] = index;
+        return sqe;
+    }
+
+    void Submit() {
+        __atomic_store_n(sq_tail_, *sq_tail_ + 1, __ATOMIC_RELEASE);
+        AddStatsCount(StatsCount::IO_URING_ENTER);
+        while (syscall(__NR_io_uring_enter, ring_fd_, 1, 0, 0, nullptr, 0) == -1) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw system_error(errno, generic_category(), "io_uring_enter");
+            }
+        }
+    }
+
+    // Errors can't propagate out of the thread, so they are kept for the workers and for Wait(),
+    // which joins the thread and rethrows them.
+    void Reap() {
+        try {
+            ReapUntilStopped();
+        } catch (...) {
+            {
+                lock_guard<mutex> lock{mutex_};
+                if (!exception_) {
+                    exception_ = current_exception();
+                }
+                reaper_failed_ = true;
+            }
+            condition_.notify_all();
+        }
+    }
+
+    void ReapUntilStopped() {
+        SetTraceThreadName("io_uring");
+        bool stopping = false;
+        while (!stopping) {
+            AddStatsCount(StatsCount::IO_URING_ENTER);
+            if (syscall(__NR_io_uring_enter, ring_fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0)
+                == -1 && errno != EINTR) {
+                throw system_error(errno, generic_category(), "io_uring_enter");
+            }
+            uint32_t head = *cq_head_;
+            uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+                if (cqe.user_data == STOP_USER_DATA) {
+                    stopping = true;
+                    continue;
+                }
+                Complete(cqe.user_data, cqe.res);
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    void Complete(size_t buffer_index, int result) {
+        Request request{};
+        {
+            lock_guard<mutex> lock{mutex_};
+            request = move(requests_[buffer_index]);
+        }
+        exception_ptr exception{};
+        try {
+            if (result < 0) {
+                throw system_error(-result, generic_category(), request.file->path());
+            }
+            // Short writes are rare on regular files, so just finish them synchronously.
+            auto written = static_cast<size_t>(result);
+            AddStatsCount(StatsCount::BYTES_WRITTEN, written);
+            if (trace.enabled) {
+                AddTraceEvent({ "io_uring_write", 'b', trace.next_id++, request.start,
+                                chrono::steady_clock::now(),
+                                "\"size\":" + to_string(request.size) });
+            }
+            if (written < request.size) {
+                request.file->Write(buffers_ + buffer_index * buffer_size_ + written,
+                                    request.size - written, request.offset + written);
+            }
+        } catch (...) {
+            exception = current_exception();
+        }
+        request.file.reset();
+        {
+            lock_guard<mutex> lock{mutex_};
+            if (exception && !exception_) {
+                exception_ = exception;
+            }
+            free_buffers_.push_back(buffer_index);
+            --in_flight_;
+        }
+        condition_.notify_all();
+    }
+
+    size_t buffer_count_;
+    size_t buffer_size_;
+    uint8_t *buffers_ = nullptr;
+    vector<Request> requests_;
+    bool is_registered_ = false;
+
+    int ring_fd_ = -1;
+    void *sq_ring_ = MAP_FAILED;
+    size_t sq_ring_size_ = 0;
+    void *cq_ring_ = MAP_FAILED;
+    size_t cq_ring_size_ = 0;
+    void *sqes_ = MAP_FAILED;
+    size_t sqes_size_ = 0;
+    uint32_t *sq_tail_ = nullptr;
+    uint32_t sq_mask_ = 0;
+    uint32_t *sq_array_ = nullptr;
+    uint32_t *cq_head_ = nullptr;
+    uint32_t *cq_tail_ = nullptr;
+    uint32_t cq_mask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+
+    mutex submit_mutex_;
+    mutex mutex_;
+    condition_variable condition_;
+    vector<size_t> free_buffers_;
+    size_t in_flight_ = 0;
+    exception_ptr exception_;
+    bool reaper_failed_ = false;
+    thread reaper_;
+};
+
+#else
+
+// Without io_uring, output is always written by the workers with pwrite().
+class UringWriter {
+public:
+    static unique_ptr<UringWriter> Create(size_t, size_t) {
+        return nullptr;
+    }
+
+    size_t buffer_size() const {
+        return 0;
+    }
+
+    uint8_t *AcquireBuffer(size_t &) {
+        return nullptr;
+    }
+
+    void Write(const shared_ptr<OutputFile> &, size_t, size_t, size_t) {}
+
+    void Wait() {}
+};
+
+#endif
+
+void Usage(const string &program_name) {
+    cerr << "Usage: " << program_name << " -l [OPTION...] IGA_FILE" << endl
+            << "Usage: " << program_name
+            << " -x [OPTION...] IGA_FILE [OUTPUT_DIRECOTRY [NAME...]]" << endl
+            << "Usage: " << program_name << " -p [OPTION...] IGA_FILE NAME..." << endl
+            << "Usage: " << program_name
+            << " -z [OPTION...] ZIP_FILE IGA_FILE DIRECTORY [IGA_FILE DIRECTORY]..." << endl
+            << "Usage: " << program_name
+            << " --plan [OPTION...] PLAN_FILE INPUT_DIRECTORY OUTPUT_DIRECTORY|OUTPUT_ZIP_FILE"
+            << endl
+            << "Usage: " << program_name << " -c [-j JOBS] IGA_FILE INPUT_FILE..." << endl
+            << "Usage: " << program_name << " --stream tar|manifest IGA_FILE|- <INPUT" << endl
+            << "Usage: " << program_name << " -n NAMES_FILE <NAME_LIST" << endl
+            << "Options: -j JOBS, --index-cache DIRECTORY, --names NAMES_FILE, --guess PATTERN,"
+               " --lowercase, --io-uring, --write-size SIZE, --sync, --incremental, --verify,"
+               " --stats json, --trace TRACE_FILE"
+            << endl;
+}
+
+string GetEntryTraceArgs(const Entry &entry, uint32_t begin, uint32_t end) {
+    if (!trace.enabled) {
+        return {};
+    }
+    return "\"name\":" + GetJsonString(entry.name) + ",\"begin\":" + to_string(begin)
+           + ",\"end\":" + to_string(end);
+}
+
+// Runs process_chunk(index, begin, end) on the pool for every entry in indices. Entries larger
+// than CHUNK_SIZE are split into chunks, smaller ones are batched together, and finish_entry(index)
+// is called after the last chunk of an entry is processed. The callbacks must outlive the tasks.
+void ScheduleEntryChunks(ThreadPool &pool, const vector<Entry> &entries,
+                         const vector<size_t> &indices,
+                         const function<void(size_t, uint32_t, uint32_t)> &process_chunk,
+                         const function<void(size_t)> &finish_entry) {
+    AddStatsCount(StatsCount::ENTRIES, indices.size());
+    vector<size_t> batch{};
+    size_t batch_size = 0;
+    auto submit_batch = [&]() {
+        if (batch.empty()) {
+            return;
+        }
+        pool.Submit([&entries, &process_chunk, &finish_entry, batch]() {
+            for (size_t index : batch) {
+                TraceSpan span{"entry", GetEntryTraceArgs(entries[index], 0, entries[index].size)};
+                process_chunk(index, 0, entries[index].size);
+                finish_entry(index);
+            }
+        });
+        batch.clear();
+        batch_size = 0;
+    };
+    for (size_t index : indices) {
+        uint32_t size = entries[index].size;
+        if (size <= CHUNK_SIZE) {
+            batch.push_back(index);
+            batch_size += size;
+            if (batch_size >= CHUNK_SIZE || batch.size() >= MAX_BATCH_ENTRIES) {
+                submit_batch();
+            }
+            continue;
+        }
+        uint32_t chunk_count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        auto remaining_chunks = make_shared<atomic<uint32_t>>(chunk_count);
+        for (uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+            uint32_t begin = chunk * CHUNK_SIZE;
+            uint32_t end = min(size, begin + CHUNK_SIZE);
+            pool.Submit([&entries, &process_chunk, &finish_entry, index, begin, end,
+                         remaining_chunks]() {
+                TraceSpan span{"entry", GetEntryTraceArgs(entries[index], begin, end)};
+                process_chunk(index, begin, end);
+                if (--*remaining_chunks == 0) {
+                    finish_entry(index);
+                }
+            });
+        }
+    }
+    submit_batch();
+}
+
+// CRC-32 as used by ZIP, in the reflected bit order. CRC32_TABLES[k][byte] is the CRC of byte
+// followed by k zero bytes, for processing 8 bytes at a time.
+#define CRC32_POLYNOMIAL 0xEDB88320u
+
+struct Crc32Tables {
+    uint32_t tables[8][256];
+};
+
+constexpr Crc32Tables CreateCrc32Tables() {
+    Crc32Tables tables{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (size_t j = 0; j < 8; ++j) {
+            crc = crc & 1u ? (crc >> 1u) ^ CRC32_POLYNOMIAL : crc >> 1u;
+        }
+        tables.tables[0][i] = crc;
+    }
+    for (size_t k = 1; k < 8; ++k) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = tables.tables[k - 1][i];
+            tables.tables[k][i] = (crc >> 8u) ^ tables.tables[0][crc & 0xFFu];
+        }
+    }
+    return tables;
+}
+
+constexpr Crc32Tables CRC32_TABLES = CreateCrc32Tables();
+
+uint32_t UpdateCrc32(uint32_t crc, const uint8_t *data, size_t size) {
+    const auto &tables = CRC32_TABLES.tables;
+    crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = tables[7][word & 0xFFu] ^ tables[6][(word >> 8u) & 0xFFu]
+              ^ tables[5][(word >> 16u) & 0xFFu] ^ tables[4][(word >> 24u) & 0xFFu]
+              ^ tables[3][(word >> 32u) & 0xFFu] ^ tables[2][(word >> 40u) & 0xFFu]
+              ^ tables[1][(word >> 48u) & 0xFFu] ^ tables[0][word >> 56u];
+    }
+#endif
+    for (; size > 0; ++data, --size) {
+        crc = (crc >> 8u) ^ tables[0][(crc ^ *data) & 0xFFu];
+    }
+    return ~crc;
+}
+
+// Multiplies two polynomials modulo the CRC-32 polynomial.
+constexpr uint32_t MultiplyCrc32(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31u; bit != 0; bit >>= 1u) {
+        if (a & bit) {
+            product ^= b;
+        }
+        b = b & 1u ? (b >> 1u) ^ CRC32_POLYNOMIAL : b >> 1u;
+    }
+    return product;
+}
+
+struct Crc32Powers {
+    // x^(2^i) modulo the CRC-32 polynomial.
+    uint32_t powers[64];
+};
+
+constexpr Crc32Powers CreateCrc32Powers() {
+    Crc32Powers powers{};
+    uint32_t power = 1u << 30u;
+    for (size_t i = 0; i < 64; ++i) {
+        powers.powers[i] = power;
+        power = MultiplyCrc32(power, power);
+    }
+    return powers;
+}
+
+constexpr Crc32Powers CRC32_POWERS = CreateCrc32Powers();
+
+// Returns the CRC of the concatenation of two pieces from their CRCs, where the second one is
+// size bytes long.
+uint32_t CombineCrc32(uint32_t crc1, uint32_t crc2, uint64_t size2) {
+    // Appending size2 bytes multiplies the first CRC by x^(8 * size2).
+    uint32_t shift = 1u << 31u;
+    for (size_t i = 3; size2 != 0; size2 >>= 1u, ++i) {
+        if (size2 & 1u) {
+            shift = MultiplyCrc32(CRC32_POWERS.powers[i], shift);
+        }
+    }
+    return MultiplyCrc32(shift, crc1) ^ crc2;
+}
+
+#define URING_BUFFER_MEMORY (16u * 1024 * 1024)
+
+#define MIN_URING_BUFFER_COUNT 8u
+
+// Returns the io_uring writer if the options ask for it, or null to write with pwrite().
+unique_ptr<UringWriter> CreateUringWriter(bool io_uring, size_t write_size) {
+    if (!io_uring) {
+        return nullptr;
+    }
+    size_t buffer_count = max<size_t>(URING_BUFFER_MEMORY / write_size, MIN_URING_BUFFER_COUNT);
+    unique_ptr<UringWriter> writer = UringWriter::Create(buffer_count, write_size);
+    if (!writer) {
+        cerr << "Warning: io_uring is not available, writing with pwrite()" << endl;
+    }
+    return writer;
+}
+
+// Encrypts or decrypts [begin, end) of an entry. If crc isn't null, it is also updated with the
+// output. If writer isn't null, the output is written asynchronously through it, and the caller
+// must wait for it. Otherwise it is written write_size bytes at a time.
+void CryptEntryChunk(const uint8_t *entry_data, uint32_t begin, uint32_t end,
+                     const uint8_t *key_stream, const shared_ptr<OutputFile> &output_file,
+                     size_t output_offset, uint32_t *crc = nullptr, UringWriter *writer = nullptr,
+                     size_t write_size = BUFFER_SIZE) {
+    if (writer != nullptr) {
+        uint32_t size = begin;
+        while (size < end) {
+            size_t buffer_index;
+            uint8_t *buffer;
+            {
+                // Waiting for a free buffer is waiting for earlier writes.
+                StatsTimer timer{StatsTime::ENTRY_WRITE};
+                buffer = writer->AcquireBuffer(buffer_index);
+            }
+            uint32_t transfer_size = min<uint32_t>(writer->buffer_size(), end - size);
+            {
+                StatsTimer timer{StatsTime::ENTRY_DECRYPT};
+                CryptAt(buffer, entry_data + size, transfer_size, size, key_stream);
+                if (crc != nullptr) {
+                    *crc = UpdateCrc32(*crc, buffer, transfer_size);
+                }
+            }
+            AddStatsCount(StatsCount::BYTES_DECRYPTED, transfer_size);
+            {
+                StatsTimer timer{StatsTime::ENTRY_WRITE};
+                writer->Write(output_file, buffer_index, transfer_size, output_offset + size);
+            }
+            size += transfer_size;
+        }
+        return;
+    }
+    alignas(64) uint8_t stack_buffer[BUFFER_SIZE];
+    uint8_t *buffer = stack_buffer;
+    if (write_size > BUFFER_SIZE) {
+        // Large writes need a buffer that doesn't fit on the stack, kept for the thread.
+        thread_local vector<uint8_t> large_buffer{};
+        large_buffer.resize(max(large_buffer.size(), write_size));
+        buffer = large_buffer.data();
+    }
+    uint32_t size = begin;
+    while (size < end) {
+        uint32_t transferSize = min<uint32_t>(write_size, end - size);
+        {
+            StatsTimer timer{StatsTime::ENTRY_DECRYPT};
+            CryptAt(buffer, entry_data + size, transferSize, size, key_stream);
+            if (crc != nullptr) {
+                *crc = UpdateCrc32(*crc, buffer, transferSize);
+            }
+        }
+        AddStatsCount(StatsCount::BYTES_DECRYPTED, transferSize);
+        {
+            StatsTimer timer{StatsTime::ENTRY_WRITE};
+            output_file->Write(buffer, transferSize, output_offset + size);
+        }
+        size += transferSize;
+    }
+}
+
+const uint32_t MD5_INITIAL_STATE[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+
+const uint32_t MD5_CONSTANTS[64] = {
+    0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+    0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE, 0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+    0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+    0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+    0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C, 0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+    0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05, 0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+    0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+    0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1, 0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+};
+
+const uint32_t MD5_SHIFTS[4][4] = { { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 },
+                                    { 6, 10, 15, 21 } };
+
+// The longest name that still fits in a single MD5 block with its padding.
+#define MD5_MAX_NAME_LENGTH 55u
+
+// Runs the MD5 compression function on one block. V is either uint32_t, or a vector of uint32_t
+// for hashing one block per lane; this is always inlined so that it is compiled for the target of
+// the caller.
+template <typename V>
+__attribute__((always_inline)) inline void Md5Transform(V (&state)[4], const V (&words)[16]) {
+    V a = state[0];
+    V b = state[1];
+    V c = state[2];
+    V d = state[3];
+#pragma GCC unroll 64
+    for (size_t i = 0; i < 64; ++i) {
+        V f;
+        size_t word;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            word = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            word = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            word = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            word = (7 * i) % 16;
+        }
+        uint32_t shift = MD5_SHIFTS[i / 16][i % 4];
+        f = f + a + MD5_CONSTANTS[i] + words[word];
+        a = d;
+        d = c;
+        c = b;
+        b = b + ((f << shift) | (f >> (32 - shift)));
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+// Pads a message of length bytes in a single MD5 block.
+void PadMd5Block(uint8_t (&block)[64], size_t length) {
+    fill(block + length, block + 56, 0);
+    block[length] = 0x80;
+    uint64_t bit_length = length * 8;
+    for (size_t i = 0; i < sizeof(bit_length); ++i) {
+        block[56 + i] = static_cast<uint8_t>(bit_length >> (8 * i));
+    }
+}
+
+// The encrypted name of a name is derived from the last 12 hexadecimal digits of the MD5 of its
+// lower-cased form, i.e. the last 6 bytes of the digest, reversed and remapped with the position
+// into base 9 digits or base 25 letters. ENCRYPTED_NAME_DIGITS[i][nibble] is the value that the
+// i-th reversed hexadecimal digit adds to the key packed by PackEncryptedName().
+struct EncryptedNameDigits {
+    uint64_t digits[12][16];
+};
+
+constexpr EncryptedNameDigits CreateEncryptedNameDigits() {
+    EncryptedNameDigits digits{};
+    for (size_t i = 0; i < 12; ++i) {
+        uint64_t place = 1;
+        for (size_t j = i + 1; j < 12; ++j) {
+            place *= 36;
+        }
+        for (uint32_t nibble = 0; nibble < 16; ++nibble) {
+            uint32_t ordinal = nibble < 10 ? '0' + nibble : 'a' + nibble - 10;
+            uint32_t value = ordinal + static_cast<uint32_t>(i) + 1;
+            uint64_t digit = nibble < 10 ? value % 9 : value % 25 + 10;
+            digits.digits[i][nibble] = digit * place;
+        }
+    }
+    return digits;
+}
+
+constexpr EncryptedNameDigits ENCRYPTED_NAME_DIGITS = CreateEncryptedNameDigits();
+
+uint64_t GetEncryptedNameKey(uint32_t digest_c, uint32_t digest_d) {
+    // Digest bytes 10 to 15, from the last one.
+    uint8_t bytes[6] = {
+        static_cast<uint8_t>(digest_d >> 24u), static_cast<uint8_t>(digest_d >> 16u),
+        static_cast<uint8_t>(digest_d >> 8u), static_cast<uint8_t>(digest_d),
+        static_cast<uint8_t>(digest_c >> 24u), static_cast<uint8_t>(digest_c >> 16u)
+    };
+    uint64_t key = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(bytes); ++i) {
+        // Reversing the hexadecimal digits puts the low nibble of each byte first.
+        key += ENCRYPTED_NAME_DIGITS.digits[2 * i][bytes[i] & 0x0Fu];
+        key += ENCRYPTED_NAME_DIGITS.digits[2 * i + 1][bytes[i] >> 4u];
+    }
+    return key;
+}
+
+// Returns the key of the encrypted name for a name.
+uint64_t EncryptName(string_view name) {
+    if (name.size() > MD5_MAX_NAME_LENGTH) {
+        throw invalid_argument("Name too long: " + string{name});
+    }
+    uint8_t block[64];
+    for (size_t i = 0; i < name.size(); ++i) {
+        block[i] = static_cast<uint8_t>(ToLowerAscii(name[i]));
+    }
+    PadMd5Block(block, name.size());
+    uint32_t words[16];
+    for (size_t i = 0; i < 16; ++i) {
+        words[i] = block[4 * i] | block[4 * i + 1] << 8u | block[4 * i + 2] << 16u
+                   | static_cast<uint32_t>(block[4 * i + 3]) << 24u;
+    }
+    uint32_t state[4];
+    copy(MD5_INITIAL_STATE, MD5_INITIAL_STATE + 4, state);
+    Md5Transform(state, words);
+    return GetEncryptedNameKey(state[2], state[3]);
+}
+
+typedef uint32_t Md5Lanes __attribute__((vector_size(32)));
+
+#define MD5_LANES (sizeof(Md5Lanes) / sizeof(uint32_t))
+
+// Hashes MD5_LANES single-block messages at once, with word i of lane j in words[i][j], and
+// returns the last two words of each digest.
+typedef void (*Md5LanesFunction)(const uint32_t (&words)[16][MD5_LANES],
+                                 uint32_t (&digests_c)[MD5_LANES],
+                                 uint32_t (&digests_d)[MD5_LANES]);
+
+__attribute__((always_inline)) inline void Md5LanesImpl(const uint32_t (&words)[16][MD5_LANES],
+                                                        uint32_t (&digests_c)[MD5_LANES],
+                                                        uint32_t (&digests_d)[MD5_LANES]) {
+    Md5Lanes lane_words[16];
+    for (size_t i = 0; i < 16; ++i) {
+        memcpy(&lane_words[i], words[i], sizeof(Md5Lanes));
+    }
+    Md5Lanes state[4];
+    for (size_t i = 0; i < 4; ++i) {
+        state[i] = Md5Lanes{} + MD5_INITIAL_STATE[i];
+    }
+    Md5Transform(state, lane_words);
+    memcpy(digests_c, &state[2], sizeof(Md5Lanes));
+    memcpy(digests_d, &state[3], sizeof(Md5Lanes));
+}
+
+void Md5LanesGeneric(const uint32_t (&words)[16][MD5_LANES], uint32_t (&digests_c)[MD5_LANES],
+                     uint32_t (&digests_d)[MD5_LANES]) {
+    Md5LanesImpl(words, digests_c, digests_d);
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("avx2")))
+void Md5LanesAvx2(const uint32_t (&words)[16][MD5_LANES], uint32_t (&digests_c)[MD5_LANES],
+                  uint32_t (&digests_d)[MD5_LANES]) {
+    Md5LanesImpl(words, digests_c, digests_d);
+}
+
+#endif
+
+Md5LanesFunction SelectMd5Lanes() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return Md5LanesAvx2;
+    }
+#endif
+    return Md5LanesGeneric;
+}
+
+const Md5LanesFunction Md5LanesHash = SelectMd5Lanes();
+
+// A pattern of candidate names, where '#' matches a digit, '@' matches a lower case letter,
+// "[...]" matches a set of characters with optional ranges like "[a-f0-9]", and '\\' escapes the
+// next character.
+class NamePattern {
+public:
+    explicit NamePattern(const string &pattern) {
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            char c = pattern[i];
+            if (c == '#') {
+                positions_.emplace_back("0123456789");
+            } else if (c == '@') {
+                positions_.emplace_back("abcdefghijklmnopqrstuvwxyz");
+            } else if (c == '[') {
+                size_t end = pattern.find(']', i + 1);
+                if (end == string::npos) {
+                    throw invalid_argument("Invalid pattern: " + pattern);
+                }
+                string characters{};
+                for (size_t j = i + 1; j < end; ++j) {
+                    if (j + 2 < end && pattern[j + 1] == '-') {
+                        // An int, since a char would wrap around at a bound of CHAR_MAX.
+                        int last = static_cast<unsigned char>(pattern[j + 2]);
+                        for (int k = static_cast<unsigned char>(pattern[j]); k <= last; ++k) {
+                            characters += static_cast<char>(k);
+                        }
+                        j += 2;
+                    } else {
+                        characters += pattern[j];
+                    }
+                }
+                if (characters.empty()) {
+                    throw invalid_argument("Invalid pattern: " + pattern);
+                }
+                positions_.push_back(characters);
+                i = end;
+            } else if (c == '\\' && i + 1 < pattern.size()) {
+                positions_.emplace_back(1, pattern[++i]);
+            } else {
+                positions_.emplace_back(1, c);
+            }
+        }
+        if (positions_.empty() || positions_.size() > MD5_MAX_NAME_LENGTH) {
+            throw invalid_argument("Invalid pattern: " + pattern);
+        }
+        size_ = 1;
+        for (const auto &position : positions_) {
+            if (size_ > UINT64_MAX / position.size()) {
+                throw invalid_argument("Too many candidates: " + pattern);
+            }
+            size_ *= position.size();
+            string lower_position{position};
+            for (char &c : lower_position) {
+                c = ToLowerAscii(c);
+            }
+            lower_positions_.push_back(lower_position);
+        }
+    }
+
+    size_t length() const {
+        return positions_.size();
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    // Returns the candidate at index, with the last position varying fastest.
+    string Generate(uint64_t index) const {
+        string name(positions_.size(), '\0');
+        for (size_t i = positions_.size(); i-- > 0;) {
+            const string &position = positions_[i];
+            name[i] = position[index % position.size()];
+            index /= position.size();
+        }
+        return name;
+    }
+
+    // Writes the lower-cased candidate at index into a padded MD5 block, and the index into each
+    // position into digits for Next().
+    void Start(uint64_t index, uint8_t (&block)[64], uint32_t *digits) const {
+        for (size_t i = positions_.size(); i-- > 0;) {
+            const string &position = lower_positions_[i];
+            digits[i] = static_cast<uint32_t>(index % position.size());
+            block[i] = static_cast<uint8_t>(position[digits[i]]);
+            index /= position.size();
+        }
+        PadMd5Block(block, positions_.size());
+    }
+
+    // Advances a block written by Start() to the next candidate.
+    void Next(uint8_t (&block)[64], uint32_t *digits) const {
+        for (size_t i = positions_.size(); i-- > 0;) {
+            const string &position = lower_positions_[i];
+            if (++digits[i] == position.size()) {
+                digits[i] = 0;
+            }
+            block[i] = static_cast<uint8_t>(position[digits[i]]);
+            if (digits[i] != 0) {
+                break;
+            }
+        }
+    }
+
+private:
+    vector<string> positions_;
+    vector<string> lower_positions_;
+    uint64_t size_;
+};
+
+#define GUESS_BATCH_SIZE 65536u
+
+#define GUESS_FILTER_SIZE (1u << 20)
+
+// Hashes the candidates of the patterns on jobs threads, and returns the candidates whose
+// encrypted names are among keys. Stops early once all keys are found.
+unordered_map<uint64_t, string> GuessEncryptedNames(const vector<NamePattern> &patterns,
+                                                    const unordered_set<uint64_t> &keys,
+                                                    size_t jobs) {
+    mutex found_mutex;
+    unordered_map<uint64_t, string> found{};
+    atomic<size_t> remaining_keys{keys.size()};
+    // Rules out most candidates without hashing their keys again.
+    vector<bool> key_filter(GUESS_FILTER_SIZE);
+    for (uint64_t key : keys) {
+        key_filter[key % GUESS_FILTER_SIZE] = true;
+    }
+    ThreadPool pool{jobs};
+    for (const auto &pattern : patterns) {
+        atomic<uint64_t> next_index{0};
+        for (size_t i = 0; i < jobs; ++i) {
+            pool.Submit([&]() {
+                // Each lane walks its own stripe of a batch, advancing its block in place.
+                uint8_t blocks[MD5_LANES][64];
+                uint32_t digits[MD5_LANES][MD5_MAX_NAME_LENGTH];
+                uint64_t lane_begins[MD5_LANES];
+                uint32_t words[16][MD5_LANES];
+                uint32_t digests_c[MD5_LANES];
+                uint32_t digests_d[MD5_LANES];
+                while (remaining_keys > 0) {
+                    uint64_t begin = next_index.fetch_add(GUESS_BATCH_SIZE);
+                    if (begin >= pattern.size()) {
+                        break;
+                    }
+                    uint64_t end = min<uint64_t>(pattern.size(), begin + GUESS_BATCH_SIZE);
+                    uint64_t stripe = (end - begin + MD5_LANES - 1) / MD5_LANES;
+                    for (size_t lane = 0; lane < MD5_LANES; ++lane) {
+                        // Spare lanes at the end just hash the last candidate again.
+                        lane_begins[lane] = min(begin + lane * stripe, end - 1);
+                        pattern.Start(lane_begins[lane], blocks[lane], digits[lane]);
+                    }
+                    for (uint64_t step = 0; step < stripe; ++step) {
+                        for (size_t word = 0; word < 16; ++word) {
+                            for (size_t lane = 0; lane < MD5_LANES; ++lane) {
+                                const uint8_t *bytes = blocks[lane] + 4 * word;
+                                words[word][lane] = bytes[0] | bytes[1] << 8u | bytes[2] << 16u
+                                                    | static_cast<uint32_t>(bytes[3]) << 24u;
+                            }
+                        }
+                        Md5LanesHash(words, digests_c, digests_d);
+                        for (size_t lane = 0; lane < MD5_LANES; ++lane) {
+                            uint64_t key = GetEncryptedNameKey(digests_c[lane], digests_d[lane]);
+                            uint64_t index = lane_begins[lane] + step;
+                            if (key_filter[key % GUESS_FILTER_SIZE] && keys.count(key) != 0
+                                && index < end) {
+                                lock_guard<mutex> lock{found_mutex};
+                                if (found.emplace(key, pattern.Generate(index)).second) {
+                                    --remaining_keys;
+                                }
+                            }
+                            pattern.Next(blocks[lane], digits[lane]);
+                        }
+                    }
+                }
+            });
+        }
+        pool.Wait();
+        if (remaining_keys == 0) {
+            break;
+        }
+    }
+    return found;
+}
+
+uint64_t HashFnv1a(const void *data, size_t size) {
+    auto bytes = static_cast<const uint8_t *>(data);
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * UINT64_C(0x100000001B3);
+    }
+    return hash;
+}
+
+void AppendUint16(string &data, uint16_t value) {
+    data += static_cast<char>(value);
+    data += static_cast<char>(value >> 8u);
+}
+
+void AppendUint32(string &data, uint32_t value) {
+    AppendUint16(data, static_cast<uint16_t>(value));
+    AppendUint16(data, static_cast<uint16_t>(value >> 16u));
+}
+
+void AppendUint64(string &data, uint64_t value) {
+    AppendUint32(data, static_cast<uint32_t>(value));
+    AppendUint32(data, static_cast<uint32_t>(value >> 32u));
+}
+
+#define ZIP_LOCAL_HEADER_SIGNATURE 0x04034B50u
+#define ZIP_CENTRAL_HEADER_SIGNATURE 0x02014B50u
+#define ZIP64_END_SIGNATURE 0x06064B50u
+#define ZIP64_END_LOCATOR_SIGNATURE 0x07064B50u
+#define ZIP_END_SIGNATURE 0x06054B50u
+#define ZIP_LOCAL_HEADER_SIZE 30u
+// Unix, ZIP 3.0, as written by Info-ZIP.
+#define ZIP_VERSION_MADE_BY 0x031Eu
+#define ZIP_VERSION_STORED 10u
+#define ZIP_VERSION_ZIP64 45u
+#define ZIP64_EXTRA_ID 0x0001u
+#define ZIP_FILE_ATTRIBUTES (0100644u << 16u)
+
+// Writes a ZIP file of stored entries. Entry sizes are known in advance, so the data of all entries
+// can be written in parallel to their final offsets, and the headers once their CRCs are known.
+// There are no directory entries or extra attributes, like "zip -DX".
+class ZipWriter {
+public:
+    explicit ZipWriter(const string &path) : file_{make_shared<OutputFile>(path)} {}
+
+    ZipWriter(const ZipWriter &) = delete;
+    ZipWriter &operator=(const ZipWriter &) = delete;
+
+    // Adds an entry and returns the offset of its data.
+    uint64_t AddEntry(const string &path, uint32_t size, time_t modification_time) {
+        if (path.size() > UINT16_MAX || size == UINT32_MAX) {
+            throw out_of_range("ZIP entry path: " + path + ", size: " + to_string(size));
+        }
+        ZipEntry entry{};
+        entry.path = path;
+        entry.size = size;
+        struct tm time{};
+        localtime_r(&modification_time, &time);
+        if (time.tm_year < 80) {
+            entry.dos_date = (1 << 5u) | 1;
+        } else {
+            entry.dos_time = static_cast<uint16_t>(time.tm_hour << 11u | time.tm_min << 5u
+                                                   | time.tm_sec / 2);
+            entry.dos_date = static_cast<uint16_t>((time.tm_year - 80) << 9u
+                                                   | (time.tm_mon + 1) << 5u | time.tm_mday);
+        }
+        entry.header_offset = size_;
+        size_ += ZIP_LOCAL_HEADER_SIZE + path.size() + size;
+        entries_.push_back(move(entry));
+        return size_ - size;
+    }
+
+    // The size of the local headers and data of the entries added so far.
+    uint64_t size() const {
+        return size_;
+    }
+
+    void SetCrc32(size_t index, uint32_t crc) {
+        entries_[index].crc = crc;
+    }
+
+    const shared_ptr<OutputFile> &file() const {
+        return file_;
+    }
+
+    // Writes the local headers, central directory and end of central directory records.
+    void Finish() {
+        for (const auto &entry : entries_) {
+            string header{};
+            AppendUint32(header, ZIP_LOCAL_HEADER_SIGNATURE);
+            AppendUint16(header, ZIP_VERSION_STORED);
+            AppendCommonHeader(header, entry);
+            AppendUint16(header, 0);
+            header += entry.path;
+            file_->Write(reinterpret_cast<const uint8_t *>(header.data()), header.size(),
+                         entry.header_offset);
+        }
+
+        string directory{};
+        for (const auto &entry : entries_) {
+            bool is_zip64 = entry.header_offset >= UINT32_MAX;
+            AppendUint32(directory, ZIP_CENTRAL_HEADER_SIGNATURE);
+            AppendUint16(directory, ZIP_VERSION_MADE_BY);
+            AppendUint16(directory, is_zip64 ? ZIP_VERSION_ZIP64 : ZIP_VERSION_STORED);
+            AppendCommonHeader(directory, entry);
+            AppendUint16(directory, is_zip64 ? 12 : 0);
+            // Comment length, disk number and internal attributes.
+            AppendUint16(directory, 0);
+            AppendUint16(directory, 0);
+            AppendUint16(directory, 0);
+            AppendUint32(directory, ZIP_FILE_ATTRIBUTES);
+            AppendUint32(directory, is_zip64 ? UINT32_MAX
+                                             : static_cast<uint32_t>(entry.header_offset));
+            directory += entry.path;
+            if (is_zip64) {
+                AppendUint16(directory, ZIP64_EXTRA_ID);
+                AppendUint16(directory, 8);
+                AppendUint64(directory, entry.header_offset);
+            }
+        }
+
+        uint64_t directory_offset = size_;
+        uint64_t directory_size = directory.size();
+        bool is_zip64 = entries_.size() >= UINT16_MAX || directory_offset >= UINT32_MAX
+                        || directory_size >= UINT32_MAX;
+        if (is_zip64) {
+            uint64_t end_offset = directory_offset + directory_size;
+            AppendUint32(directory, ZIP64_END_SIGNATURE);
+            AppendUint64(directory, 44);
+            AppendUint16(directory, ZIP_VERSION_MADE_BY);
+            AppendUint16(directory, ZIP_VERSION_ZIP64);
+            AppendUint32(directory, 0);
+            AppendUint32(directory, 0);
+            AppendUint64(directory, entries_.size());
+            AppendUint64(directory, entries_.size());
+            AppendUint64(directory, directory_size);
+            AppendUint64(directory, directory_offset);
+            AppendUint32(directory, ZIP64_END_LOCATOR_SIGNATURE);
+            AppendUint32(directory, 0);
+            AppendUint64(directory, end_offset);
+            AppendUint32(directory, 1);
+        }
+        uint16_t entry_count = is_zip64 ? UINT16_MAX : static_cast<uint16_t>(entries_.size());
+        AppendUint32(directory, ZIP_END_SIGNATURE);
+        AppendUint16(directory, 0);
+        AppendUint16(directory, 0);
+        AppendUint16(directory, entry_count);
+        AppendUint16(directory, entry_count);
+        AppendUint32(directory, is_zip64 ? UINT32_MAX : static_cast<uint32_t>(directory_size));
+        AppendUint32(directory, is_zip64 ? UINT32_MAX : static_cast<uint32_t>(directory_offset));
+        AppendUint16(directory, 0);
+        file_->Write(reinterpret_cast<const uint8_t *>(directory.data()), directory.size(),
+                     directory_offset);
+        file_->Truncate(directory_offset + directory.size());
+    }
+
+private:
+    struct ZipEntry {
+        string path;
+        uint32_t size;
+        uint32_t crc;
+        uint16_t dos_time;
+        uint16_t dos_date;
+        uint64_t header_offset;
+    };
+
+    // The fields shared by local and central headers, from the flags to the path length.
+    static void AppendCommonHeader(string &header, const ZipEntry &entry) {
+        AppendUint16(header, 0);
+        // Stored.
+        AppendUint16(header, 0);
+        AppendUint16(header, entry.dos_time);
+        AppendUint16(header, entry.dos_date);
+        AppendUint32(header, entry.crc);
+        AppendUint32(header, entry.size);
+        AppendUint32(header, entry.size);
+        AppendUint16(header, static_cast<uint16_t>(entry.path.size()));
+    }
+
+    shared_ptr<OutputFile> file_;
+    vector<ZipEntry> entries_;
+    uint64_t size_ = 0;
+};
+
+const uint8_t NAMES_SIGNATURE[8] = { 'I', 'G', 'A', 'N', 'A', 'M', '0', '1' };
+
+// A name dictionary file is a NamesHeader, NamesHeader::entry_count NamesEntry sorted by key and
+// then all the names they point into, in host byte order.
+struct NamesHeader {
+    uint8_t signature[8];
+    uint64_t fingerprint;
+    uint64_t entry_count;
+    uint64_t names_length;
+};
+
+struct NamesEntry {
+    uint64_t key;
+    uint32_t name_offset;
+    uint32_t name_length;
+};
+
+// A name dictionary mapped into memory, so that it is ready without building anything at startup.
+class NameDictionary {
+public:
+    explicit NameDictionary(const string &path) : file_{path} {
+        const uint8_t *data = file_.data();
+        if (file_.size() < sizeof(header_)) {
+            throw out_of_range("Name dictionary size: " + to_string(file_.size()) + ", path: "
+                               + path);
+        }
+        memcpy(&header_, data, sizeof(header_));
+        if (!equal(header_.signature, header_.signature + ARRAY_SIZE(NAMES_SIGNATURE),
+                   NAMES_SIGNATURE)) {
+            throw invalid_argument("Not a name dictionary: " + path);
+        }
+        if (header_.entry_count > (file_.size() - sizeof(header_)) / sizeof(NamesEntry)
+            || header_.names_length != file_.size() - sizeof(header_)
+                                       - header_.entry_count * sizeof(NamesEntry)) {
+            throw out_of_range("Name dictionary size: " + to_string(file_.size()) + ", path: "
+                               + path);
+        }
+        entries_ = data + sizeof(header_);
+        names_ = {reinterpret_cast<const char *>(entries_ + header_.entry_count
+                                                 * sizeof(NamesEntry)), header_.names_length};
+    }
+
+    NameDictionary(const NameDictionary &) = delete;
+    NameDictionary &operator=(const NameDictionary &) = delete;
+
+    uint64_t fingerprint() const {
+        return header_.fingerprint;
+    }
+
+    // Returns the name for a key, or an empty string if it is unknown.
+    string_view Find(uint64_t key) const {
+        size_t begin = 0;
+        size_t end = header_.entry_count;
+        while (begin < end) {
+            size_t middle = begin + (end - begin) / 2;
+            NamesEntry entry = GetEntry(middle);
+            if (entry.key < key) {
+                begin = middle + 1;
+            } else if (entry.key > key) {
+                end = middle;
+            } else {
+                if (static_cast<uint64_t>(entry.name_offset) + entry.name_length
+                    > names_.size()) {
+                    throw out_of_range("Name offset: " + to_string(entry.name_offset)
+                                       + ", length: " + to_string(entry.name_length)
+                                       + ", names length: " + to_string(names_.size()));
+                }
+                return names_.substr(entry.name_offset, entry.name_length);
+            }
+        }
+        return {};
+    }
+
+private:
+    NamesEntry GetEntry(size_t index) const {
+        NamesEntry entry{};
+        memcpy(&entry, entries_ + index * sizeof(NamesEntry), sizeof(entry));
+        return entry;
+    }
+
+    MappedFile file_;
+    NamesHeader header_{};
+    const uint8_t *entries_ = nullptr;
+    string_view names_;
+};
+
+struct Options {
+    size_t jobs = 1;
+    string index_directory;
+    deque<NameDictionary> name_dictionaries;
+    vector<NamePattern> name_patterns;
+    bool lowercase = false;
+    bool io_uring = false;
+    size_t write_size = DEFAULT_WRITE_SIZE;
+    bool sync = false;
+    bool incremental = false;
+    bool verify = false;
+};
+
+const uint8_t INDEX_SIGNATURE[8] = { 'I', 'G', 'A', 'I', 'D', 'X', '0', '1' };
+
+// An index file is an IndexHeader, the archive path, IndexHeader::entry_count IndexEntry and then
+// all the strings the entries point into, in host byte order.
+struct IndexHeader {
+    uint8_t signature[8];
+    uint64_t names_fingerprint;
+    uint64_t archive_size;
+    int64_t archive_modification_seconds;
+    int64_t archive_modification_nanoseconds;
+    uint32_t path_length;
+    uint32_t entry_count;
+    uint64_t strings_length;
+};
+
+struct IndexEntry {
+    uint32_t offset;
+    uint32_t size;
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint32_t encrypted_name_length;
+    uint64_t encrypted_name_offset;
+};
+
+class Archive {
+public:
+    // If options.index_directory isn't empty, the parsed entries are cached there and reused as
+    // long as the archive keeps its path, size and modification time. Encrypted names that are
+    // still unknown are then guessed from options.name_patterns.
+    Archive(const string &path, const Options &options) {
+        TraceSpan span{"archive_open", trace.enabled ? "\"path\":" + GetJsonString(path) : ""};
+        AddStatsCount(StatsCount::MMAP);
+        name_dictionaries_ = &options.name_dictionaries;
+        names_fingerprint_ = ENCRYPTED_NAMES_FINGERPRINT;
+        for (const auto &name_dictionary : options.name_dictionaries) {
+            uint64_t fingerprint = name_dictionary.fingerprint();
+            names_fingerprint_ = HashFnv1a(&fingerprint, sizeof(fingerprint)) ^ names_fingerprint_;
+        }
+        archive_ = make_unique<IgaArchive>(
+                path, [&](const MappedFile &file, vector<Entry> &entries, string &names) {
+                    Load(file, entries, names, path, options.index_directory);
+                    if (!options.name_patterns.empty()) {
+                        RecoverEncryptedNames(entries, options.name_patterns, options.jobs);
+                    }
+                });
+        AddStatsCount(StatsCount::ARCHIVE_ENTRIES, entries().size());
+        for (const auto &entry : entries()) {
+            if (!entry.encrypted_name.empty() && entry.name == entry.encrypted_name) {
+                cerr << "Warning: Unknown encrypted name: " << entry.encrypted_name << endl;
+            }
+        }
+    }
+
+    Archive(const Archive &) = delete;
+    Archive &operator=(const Archive &) = delete;
+
+    const MappedFile &file() const {
+        return archive_->file();
+    }
+
+    const vector<Entry> &entries() const {
+        return archive_->entries();
+    }
+
+    // Finds the index of the last entry with the name, or else with the encrypted name.
+    bool FindEntry(string_view name, size_t &index) const {
+        const Entry *entry = archive_->FindEntry(name);
+        if (entry == nullptr) {
+            return false;
+        }
+        index = entry - entries().data();
+        return true;
+    }
+
+private:
+    void Load(const MappedFile &file, vector<Entry> &entries, string &names, const string &path,
+              const string &index_directory) {
+        if (index_directory.empty()) {
+            Parse(file, entries, names);
+            return;
+        }
+        char *real_path = realpath(path.c_str(), nullptr);
+        if (real_path == nullptr) {
+            throw system_error(errno, generic_category(), path);
+        }
+        real_path_ = real_path;
+        free(real_path);
+        char index_name[32];
+        snprintf(index_name, sizeof(index_name), "%016" PRIx64 ".igaidx",
+                 HashFnv1a(real_path_.data(), real_path_.size()));
+        string index_path = index_directory + SEPARATOR + index_name;
+        {
+            StatsTimer timer{StatsTime::INDEX_LOAD};
+            if (LoadIndex(index_path, file, entries)) {
+                return;
+            }
+        }
+        Parse(file, entries, names);
+        SaveIndex(index_path, file, entries);
+    }
+
+    // Recovered names are not written to the index, which only depends on the archive and the
+    // built-in names.
+    void RecoverEncryptedNames(vector<Entry> &entries, const vector<NamePattern> &patterns,
+                               size_t jobs) {
+        unordered_set<uint64_t> keys{};
+        for (const auto &entry : entries) {
+            uint64_t key;
+            if (entry.name == entry.encrypted_name
+                && PackEncryptedName(entry.encrypted_name, key)) {
+                keys.insert(key);
+            }
+        }
+        if (keys.empty()) {
+            return;
+        }
+        unordered_map<uint64_t, string> names = GuessEncryptedNames(patterns, keys, jobs);
+        for (auto &entry : entries) {
+            uint64_t key;
+            if (entry.name != entry.encrypted_name
+                || !PackEncryptedName(entry.encrypted_name, key)) {
+                continue;
+            }
+            auto iter = names.find(key);
+            if (iter != names.end()) {
+                entry.name = recovered_names_.emplace_back(iter->second);
+            }
+        }
+    }
+
+    void Parse(const MappedFile &file, vector<Entry> &entries, string &names) {
+        ParseTimes times{};
+        ParseArchive(file, entries, names, [this](uint64_t key) { return FindName(key); },
+                     stats.enabled ? &times : nullptr);
+        AddStatsTime(StatsTime::HEADER_PARSE, times.entries);
+        AddStatsTime(StatsTime::NAME_DECODE, times.names);
+        AddStatsTime(StatsTime::NAME_LOOKUP, times.name_lookups);
+        AddStatsCount(StatsCount::NAME_LOOKUPS, times.name_lookup_count);
+    }
+
+    // Name dictionaries take precedence over the built-in names.
+    string_view FindName(uint64_t key) const {
+        for (const auto &name_dictionary : *name_dictionaries_) {
+            string_view name = name_dictionary.Find(key);
+            if (!name.empty()) {
+                return name;
+            }
+        }
+        return FindEncryptedName(key);
+    }
+
+    bool IsIndexFor(const IndexHeader &header, const MappedFile &file) const {
+        const struct stat &status = file.status();
+        return equal(header.signature, header.signature + ARRAY_SIZE(INDEX_SIGNATURE),
+                     INDEX_SIGNATURE)
+               && header.names_fingerprint == names_fingerprint_
+               && header.archive_size == file.size()
+               && header.archive_modification_seconds == status.st_mtim.tv_sec
+               && header.archive_modification_nanoseconds == status.st_mtim.tv_nsec
+               && header.path_length == real_path_.size();
+    }
+
+    // The entries point into the index, which stays mapped as long as the archive is open.
+    bool LoadIndex(const string &index_path, const MappedFile &file, vector<Entry> &entries) {
+        try {
+            index_ = make_unique<MappedFile>(index_path);
+        } catch (const system_error &) {
+            return false;
+        }
+        const uint8_t *data = index_->data();
+        size_t size = index_->size();
+        IndexHeader header{};
+        if (size < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (!IsIndexFor(header, file)
+            || size != sizeof(header) + header.path_length
+                       + static_cast<uint64_t>(header.entry_count) * sizeof(IndexEntry)
+                       + header.strings_length
+            || string_view{reinterpret_cast<const char *>(data + sizeof(header)),
+                           header.path_length} != real_path_) {
+            return false;
+        }
+        const uint8_t *index_entries = data + sizeof(header) + header.path_length;
+        string_view strings{reinterpret_cast<const char *>(
+                index_entries + header.entry_count * sizeof(IndexEntry)), header.strings_length};
+        entries.resize(header.entry_count);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            IndexEntry index_entry{};
+            memcpy(&index_entry, index_entries + i * sizeof(IndexEntry), sizeof(index_entry));
+            if (index_entry.name_offset + index_entry.name_length > strings.size()
+                || index_entry.encrypted_name_offset + index_entry.encrypted_name_length
+                   > strings.size()) {
+                entries.clear();
+                return false;
+            }
+            Entry &entry = entries[i];
+            entry.offset = index_entry.offset;
+            entry.size = index_entry.size;
+            entry.name = strings.substr(index_entry.name_offset, index_entry.name_length);
+            entry.encrypted_name = strings.substr(index_entry.encrypted_name_offset,
+                                                  index_entry.encrypted_name_length);
+        }
+        return true;
+    }
+
+    void SaveIndex(const string &index_path, const MappedFile &file,
+                   const vector<Entry> &entries) const {
+        const struct stat &status = file.status();
+        IndexHeader header{};
+        memcpy(header.signature, INDEX_SIGNATURE, sizeof(header.signature));
+        header.names_fingerprint = names_fingerprint_;
+        header.archive_size = file.size();
+        header.archive_modification_seconds = status.st_mtim.tv_sec;
+        header.archive_modification_nanoseconds = status.st_mtim.tv_nsec;
+        header.path_length = static_cast<uint32_t>(real_path_.size());
+        header.entry_count = static_cast<uint32_t>(entries.size());
+        string strings{};
+        vector<IndexEntry> index_entries(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const Entry &entry = entries[i];
+            IndexEntry &index_entry = index_entries[i];
+            index_entry.offset = entry.offset;
+            index_entry.size = entry.size;
+            index_entry.name_offset = strings.size();
+            index_entry.name_length = static_cast<uint32_t>(entry.name.size());
+            strings += entry.name;
+            index_entry.encrypted_name_offset = strings.size();
+            index_entry.encrypted_name_length = static_cast<uint32_t>(entry.encrypted_name.size());
+            strings += entry.encrypted_name;
+        }
+        header.strings_length = strings.size();
+
+        // Write to a temporary file and rename it over, so that readers never see a partial index.
+        string temporary_path = index_path + "." + to_string(getpid()) + ".tmp";
+        try {
+            OutputFile index_file{temporary_path};
+            size_t offset = 0;
+            index_file.Write(reinterpret_cast<const uint8_t *>(&header), sizeof(header), offset);
+            offset += sizeof(header);
+            index_file.Write(reinterpret_cast<const uint8_t *>(real_path_.data()),
+                             real_path_.size(), offset);
+            offset += real_path_.size();
+            index_file.Write(reinterpret_cast<const uint8_t *>(index_entries.data()),
+                             index_entries.size() * sizeof(IndexEntry), offset);
+            offset += index_entries.size() * sizeof(IndexEntry);
+            index_file.Write(reinterpret_cast<const uint8_t *>(strings.data()), strings.size(),
+                             offset);
+        } catch (const system_error &e) {
+            cerr << "Warning: Unable to write index: " << e.what() << endl;
+            unlink(temporary_path.c_str());
+            return;
+        }
+        if (rename(temporary_path.c_str(), index_path.c_str()) == -1) {
+            cerr << "Warning: Unable to write index: " << index_path << ": " << strerror(errno)
+                 << endl;
+            unlink(temporary_path.c_str());
+        }
+    }
+
+    const deque<NameDictionary> *name_dictionaries_ = nullptr;
+    uint64_t names_fingerprint_ = 0;
+    deque<string> recovered_names_;
+    string real_path_;
+    unique_ptr<MappedFile> index_;
+    unique_ptr<IgaArchive> archive_;
+};
+
+void AppendOutputName(string &path, string_view name, bool lowercase) {
+    if (lowercase) {
+        for (char c : name) {
+            path += ToLowerAscii(c);
+        }
+    } else {
+        path += name;
+    }
+}
+
+vector<size_t> FindEntries(const Archive &archive, const vector<string> &names) {
+    vector<size_t> indices{};
+    for (const auto &name : names) {
+        size_t index;
+        if (!archive.FindEntry(name, index)) {
+            cerr << "Entry not found: " << name << endl;
+            exit(1);
+        }
+        indices.push_back(index);
+    }
+    return indices;
+}
+
+// Writes all of data to a file descriptor that may be a pipe, retrying short writes.
+void WriteFully(int fd, const uint8_t *data, size_t size, const string &path) {
+    while (size > 0) {
+        AddStatsCount(StatsCount::WRITE);
+        ssize_t written = write(fd, data, size);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw system_error(errno, generic_category(), path);
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+#define JOURNAL_NAME ".igatool-journal"
+
+// Records which files an incremental extraction starts ("+PATH") and finishes ("-PATH") in its
+// output directory. Files are allocated at their full size before they are written, so after an
+// interrupted run this is what tells a partial file from a complete one. The journal is removed
+// once an extraction completes.
+class ExtractionJournal {
+public:
+    explicit ExtractionJournal(const string &directory)
+        : path_{directory + SEPARATOR + JOURNAL_NAME} {
+        ifstream stream{path_};
+        string line{};
+        while (getline(stream, line)) {
+            if (line.size() < 2) {
+                continue;
+            }
+            if (line[0] == '+') {
+                partial_paths_.insert(line.substr(1));
+            } else if (line[0] == '-') {
+                partial_paths_.erase(line.substr(1));
+            }
+        }
+        AddStatsCount(StatsCount::OPEN);
+        fd_ = open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if (fd_ == -1) {
+            throw system_error(errno, generic_category(), path_);
+        }
+    }
+
+    ExtractionJournal(const ExtractionJournal &) = delete;
+    ExtractionJournal &operator=(const ExtractionJournal &) = delete;
+
+    ~ExtractionJournal() {
+        AddStatsCount(StatsCount::CLOSE);
+        close(fd_);
+    }
+
+    bool IsPartial(const string &path) const {
+        return partial_paths_.count(path) != 0;
+    }
+
+    // Records all the files about to be written at once, before any of them is opened.
+    void Begin(const vector<string> &paths) {
+        string lines{};
+        for (const auto &path : paths) {
+            lines += '+';
+            lines += path;
+            lines += '\n';
+        }
+        WriteFully(fd_, reinterpret_cast<const uint8_t *>(lines.data()), lines.size(), path_);
+    }
+
+    // Safe to call from any thread, since each line is a single append.
+    void End(const string &path) {
+        string line = '-' + path + '\n';
+        WriteFully(fd_, reinterpret_cast<const uint8_t *>(line.data()), line.size(), path_);
+    }
+
+    void Remove() {
+        if (unlink(path_.c_str()) == -1) {
+            throw system_error(errno, generic_category(), path_);
+        }
+    }
+
+private:
+    string path_;
+    int fd_;
+    unordered_set<string> partial_paths_;
+};
+
+// Returns whether an earlier extraction already wrote the entry to path: the file has the size of
+// the entry and wasn't left partial, and if verify is set, it has the same content too.
+bool IsEntryExtracted(const string &path, const string &relative_path, const Entry &entry,
+                      const uint8_t *entry_data, const ExtractionJournal &journal, bool verify) {
+    StatsTimer timer{StatsTime::ENTRY_CHECK};
+    AddStatsCount(StatsCount::STAT);
+    struct stat status{};
+    if (stat(path.c_str(), &status) == -1 || !S_ISREG(status.st_mode)
+        || static_cast<uint64_t>(status.st_size) != entry.size
+        || journal.IsPartial(relative_path)) {
+        return false;
+    }
+    if (!verify) {
+        return true;
+    }
+    MappedFile file{path};
+    AddStatsCount(StatsCount::MMAP);
+    file.Advise(MADV_SEQUENTIAL);
+    const uint8_t *key_stream = GetKeyStream(entry.cipher());
+    alignas(64) uint8_t buffer[BUFFER_SIZE];
+    for (uint32_t offset = 0; offset < entry.size; offset += BUFFER_SIZE) {
+        uint32_t size = min(BUFFER_SIZE, entry.size - offset);
+        CryptAt(buffer, entry_data + offset, size, offset, key_stream);
+        if (memcmp(buffer, file.data() + offset, size) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the indices for which keep(index) is true, running it on the pool.
+vector<size_t> FilterIndices(ThreadPool &pool, const vector<size_t> &indices,
+                             const function<bool(size_t)> &keep) {
+    vector<char> kept(indices.size());
+    for (size_t begin = 0; begin < indices.size(); begin += MAX_BATCH_ENTRIES) {
+        size_t end = min<size_t>(begin + MAX_BATCH_ENTRIES, indices.size());
+        pool.Submit([&, begin, end] {
+            for (size_t i = begin; i < end; ++i) {
+                kept[i] = keep(indices[i]);
+            }
+        });
+    }
+    pool.Wait();
+    vector<size_t> kept_indices{};
+    for (size_t i = 0; i < indices.size(); ++i) {
+        if (kept[i]) {
+            kept_indices.push_back(indices[i]);
+        }
+    }
+    return kept_indices;
+}
+
+// Extracts the entries with the names, or all entries if names is empty.
+void Extract(const string &iga_path, const Options &options, bool is_list,
+             const string &output_directory, const vector<string> &names) {
+    Archive archive{iga_path, options};
+    const MappedFile &iga_file = archive.file();
+    const uint8_t *file_begin = iga_file.data();
+    const vector<Entry> &entries = archive.entries();
+
+    if (is_list) {
+        for (const auto &entry : entries) {
+            cout << entry.name << '\n';
+        }
+        cout.flush();
+        return;
+    }
+
+    // Entries are normally laid out in table order, so let the kernel read ahead for us.
+    iga_file.Advise(MADV_SEQUENTIAL);
+
+    mutex progress_mutex;
+    condition_variable progress_condition;
+    vector<bool> entries_done(entries.size());
+    bool failed = false;
+    unique_ptr<UringWriter> writer = CreateUringWriter(options.io_uring, options.write_size);
+    unique_ptr<ExtractionJournal> journal{};
+    if (options.incremental) {
+        journal = make_unique<ExtractionJournal>(output_directory);
+    }
+    auto get_relative_path = [&](size_t index) {
+        string path{};
+        AppendOutputName(path, entries[index].name, options.lowercase);
+        return path;
+    };
+    function<void(size_t)> finish_entry = [&](size_t index) {
+        // Writes through io_uring may still be in flight, so they all count as partial until the
+        // journal is removed.
+        if (journal && !writer) {
+            journal->End(get_relative_path(index));
+        }
+        {
+            lock_guard<mutex> lock{progress_mutex};
+            entries_done[index] = true;
+        }
+        progress_condition.notify_all();
+    };
+    function<void(size_t, uint32_t, uint32_t)> extract_chunk = [&](size_t index, uint32_t begin,
+                                                                    uint32_t end) {
+        const Entry &entry = entries[index];
+        try {
+            // Chunks of a split entry share the file, so only a whole entry may truncate it.
+            bool is_whole_entry = begin == 0 && end == entry.size;
+            string path{output_directory};
+            path += SEPARATOR;
+            AppendOutputName(path, entry.name, options.lowercase);
+            auto output_file = make_shared<OutputFile>(path, is_whole_entry);
+            if (!is_whole_entry) {
+                output_file->Truncate(entry.size);
+            }
+            output_file->Allocate(entry.size);
+            const uint8_t *key_stream = GetKeyStream(entry.cipher());
+            CryptEntryChunk(file_begin + entry.offset, begin, end, key_stream, output_file, 0,
+                            nullptr, writer.get(), options.write_size);
+        } catch (...) {
+            {
+                lock_guard<mutex> lock{progress_mutex};
+                failed = true;
+            }
+            progress_condition.notify_all();
+            throw;
+        }
+    };
+
+    vector<size_t> reported_indices{};
+    vector<size_t> indices{};
+    if (names.empty()) {
+        // Entries with the same path would overwrite each other, so only the last one is written.
+        unordered_map<string, size_t> lowercase_indices{};
+        if (options.lowercase) {
+            for (size_t i = 0; i < entries.size(); ++i) {
+                string name{};
+                AppendOutputName(name, entries[i].name, options.lowercase);
+                lowercase_indices[name] = i;
+            }
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            reported_indices.push_back(i);
+            size_t last_index;
+            if (options.lowercase) {
+                string name{};
+                AppendOutputName(name, entries[i].name, options.lowercase);
+                last_index = lowercase_indices[name];
+            } else if (!archive.FindEntry(entries[i].name, last_index)) {
+                last_index = entries.size();
+            }
+            if (last_index == i) {
+                indices.push_back(i);
+            } else {
+                entries_done[i] = true;
+            }
+        }
+    } else {
+        reported_indices = FindEntries(archive, names);
+        vector<bool> is_scheduled(entries.size());
+        for (size_t index : reported_indices) {
+            if (!is_scheduled[index]) {
+                is_scheduled[index] = true;
+                indices.push_back(index);
+            }
+        }
+    }
+
+    ThreadPool pool{options.jobs};
+    vector<bool> entries_skipped(entries.size());
+    if (journal) {
+        vector<size_t> scheduled_indices = FilterIndices(pool, indices, [&](size_t index) {
+            const Entry &entry = entries[index];
+            string relative_path = get_relative_path(index);
+            return !IsEntryExtracted(output_directory + SEPARATOR + relative_path, relative_path,
+                                     entry, file_begin + entry.offset, *journal, options.verify);
+        });
+        // Only what is written gets reported, so duplicates shadowed by a later entry with the
+        // same path are skipped along with entries that were already extracted.
+        entries_skipped.assign(entries.size(), true);
+        for (size_t index : indices) {
+            entries_done[index] = true;
+        }
+        vector<string> paths{};
+        for (size_t index : scheduled_indices) {
+            entries_skipped[index] = false;
+            entries_done[index] = false;
+            paths.push_back(get_relative_path(index));
+        }
+        journal->Begin(paths);
+        indices = move(scheduled_indices);
+    }
+    ScheduleEntryChunks(pool, entries, indices, extract_chunk, finish_entry);
+
+    // Report entries in order regardless of the order they are finished in, except for those that
+    // were already extracted.
+    for (size_t i : reported_indices) {
+        unique_lock<mutex> lock{progress_mutex};
+        progress_condition.wait(lock, [&] { return entries_done[i] || failed; });
+        if (!entries_done[i]) {
+            break;
+        }
+        lock.unlock();
+        if (!entries_skipped[i]) {
+            cout << entries[i].name << '\n';
+        }
+    }
+    cout.flush();
+    pool.Wait();
+    if (writer) {
+        writer->Wait();
+    }
+    if (journal) {
+        journal->Remove();
+    }
+}
+
+void Print(const string &iga_path, const Options &options, const vector<string> &names) {
+    Archive archive{iga_path, options};
+    vector<size_t> indices = FindEntries(archive, names);
+    alignas(64) uint8_t buffer[BUFFER_SIZE];
+    for (size_t index : indices) {
+        const Entry &entry = archive.entries()[index];
+        const uint8_t *entry_data = archive.file().data() + entry.offset;
+        const uint8_t *key_stream = GetKeyStream(entry.cipher());
+        uint32_t size = 0;
+        while (size < entry.size) {
+            uint32_t transferSize = min(BUFFER_SIZE, entry.size - size);
+            CryptAt(buffer, entry_data + size, transferSize, size, key_stream);
+            AddStatsCount(StatsCount::BYTES_DECRYPTED, transferSize);
+            WriteFully(STDOUT_FILENO, buffer, transferSize, "stdout");
+            size += transferSize;
+        }
+    }
+}
+
+// Entries from any number of archives, each with the path it is extracted to. A later entry with
+// the same path replaces the earlier one, like extracting into a directory would.
+class OutputTree {
+public:
+    explicit OutputTree(const Options &options) : options_(options) {}
+
+    OutputTree(const OutputTree &) = delete;
+    OutputTree &operator=(const OutputTree &) = delete;
+
+    Archive &AddArchive(const string &iga_path) {
+        Archive &archive = archives_.emplace_back(iga_path, options_);
+        archive.file().Advise(MADV_SEQUENTIAL);
+        return archive;
+    }
+
+    void AddEntry(const Archive &archive, const Entry &entry, const string &path) {
+        auto [iter, is_new] = path_indices_.emplace(path, entries.size());
+        size_t index = iter->second;
+        if (is_new) {
+            entries.emplace_back();
+            entry_data.emplace_back();
+            paths.push_back(path);
+            modification_times.emplace_back();
+        }
+        entries[index] = entry;
+        entry_data[index] = archive.file().data() + entry.offset;
+        modification_times[index] = archive.file().status().st_mtim.tv_sec;
+    }
+
+    vector<Entry> entries;
+    vector<const uint8_t *> entry_data;
+    vector<string> paths;
+    vector<time_t> modification_times;
+
+private:
+    const Options &options_;
+    deque<Archive> archives_;
+    unordered_map<string, size_t> path_indices_;
+};
+
+string GetDirectoryPrefix(const string &directory) {
+    if (directory == ".") {
+        return {};
+    }
+    string prefix{directory};
+    while (!prefix.empty() && prefix.back() == '/') {
+        prefix.pop_back();
+    }
+    prefix += '/';
+    return prefix;
+}
+
+// Writes the entries of the tree into a stored ZIP file, without writing them anywhere else first.
+void WriteZip(const OutputTree &tree, const string &zip_path, const Options &options) {
+    const vector<Entry> &entries = tree.entries;
+    ZipWriter zip{zip_path};
+    unique_ptr<UringWriter> writer = CreateUringWriter(options.io_uring, options.write_size);
+    vector<uint64_t> data_offsets(entries.size());
+    vector<vector<uint32_t>> chunk_crcs(entries.size());
+    vector<size_t> indices(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        data_offsets[i] = zip.AddEntry(tree.paths[i], entries[i].size,
+                                       tree.modification_times[i]);
+        chunk_crcs[i].resize(max<size_t>((entries[i].size + CHUNK_SIZE - 1) / CHUNK_SIZE, 1));
+        indices[i] = i;
+    }
+    zip.file()->Allocate(zip.size());
+    function<void(size_t, uint32_t, uint32_t)> extract_chunk = [&](size_t index, uint32_t begin,
+                                                                    uint32_t end) {
+        const Entry &entry = entries[index];
+        const uint8_t *key_stream = GetKeyStream(entry.cipher());
+        uint32_t crc = 0;
+        CryptEntryChunk(tree.entry_data[index], begin, end, key_stream, zip.file(),
+                        data_offsets[index], &crc, writer.get(), options.write_size);
+        chunk_crcs[index][begin / CHUNK_SIZE] = crc;
+    };
+    function<void(size_t)> finish_entry = [&](size_t index) {
+        const vector<uint32_t> &crcs = chunk_crcs[index];
+        uint32_t crc = crcs[0];
+        for (size_t i = 1; i < crcs.size(); ++i) {
+            uint32_t chunk_size = min<uint32_t>(CHUNK_SIZE,
+                                                entries[index].size - i * CHUNK_SIZE);
+            crc = CombineCrc32(crc, crcs[i], chunk_size);
+        }
+        zip.SetCrc32(index, crc);
+    };
+    ThreadPool pool{options.jobs};
+    ScheduleEntryChunks(pool, entries, indices, extract_chunk, finish_entry);
+    pool.Wait();
+    if (writer) {
+        writer->Wait();
+    }
+    zip.Finish();
+}
+
+void CreateDirectories(const string &path) {
+    for (size_t end = path.find('/', 1); ; end = path.find('/', end + 1)) {
+        string directory = path.substr(0, end);
+        if (mkdir(directory.c_str(), 0777) == -1 && errno != EEXIST) {
+            throw system_error(errno, generic_category(), directory);
+        }
+        if (end == string::npos) {
+            break;
+        }
+    }
+}
+
+// Writes the entries of the tree into a directory, creating subdirectories as needed.
+void WriteDirectory(const OutputTree &tree, const string &output_directory,
+                    const Options &options) {
+    const vector<Entry> &entries = tree.entries;
+    unordered_set<string> directories{};
+    vector<size_t> indices(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        size_t separator_index = tree.paths[i].rfind('/');
+        if (separator_index != string::npos) {
+            directories.insert(tree.paths[i].substr(0, separator_index));
+        }
+        indices[i] = i;
+    }
+    CreateDirectories(output_directory);
+    for (const auto &directory : directories) {
+        CreateDirectories(output_directory + SEPARATOR + directory);
+    }
+    unique_ptr<UringWriter> writer = CreateUringWriter(options.io_uring, options.write_size);
+    function<void(size_t, uint32_t, uint32_t)> extract_chunk = [&](size_t index, uint32_t begin,
+                                                                    uint32_t end) {
+        const Entry &entry = entries[index];
+        // Chunks of a split entry share the file, so only a whole entry may truncate it.
+        bool is_whole_entry = begin == 0 && end == entry.size;
+        auto output_file = make_shared<OutputFile>(output_directory + SEPARATOR
+                                                   + tree.paths[index], is_whole_entry);
+        if (!is_whole_entry) {
+            output_file->Truncate(entry.size);
+        }
+        output_file->Allocate(entry.size);
+        const uint8_t *key_stream = GetKeyStream(entry.cipher());
+        CryptEntryChunk(tree.entry_data[index], begin, end, key_stream, output_file, 0, nullptr,
+                        writer.get(), options.write_size);
+    };
+    unique_ptr<ExtractionJournal> journal{};
+    if (options.incremental) {
+        journal = make_unique<ExtractionJournal>(output_directory);
+    }
+    function<void(size_t)> finish_entry = [&](size_t index) {
+        // Like in Extract(), io_uring writes count as partial until the journal is removed.
+        if (journal && !writer) {
+            journal->End(tree.paths[index]);
+        }
+    };
+    ThreadPool pool{options.jobs};
+    if (journal) {
+        indices = FilterIndices(pool, indices, [&](size_t index) {
+            return !IsEntryExtracted(output_directory + SEPARATOR + tree.paths[index],
+                                     tree.paths[index], entries[index], tree.entry_data[index],
+                                     *journal, options.verify);
+        });
+        vector<string> paths{};
+        for (size_t index : indices) {
+            paths.push_back(tree.paths[index]);
+        }
+        journal->Begin(paths);
+    }
+    ScheduleEntryChunks(pool, entries, indices, extract_chunk, finish_entry);
+    pool.Wait();
+    if (writer) {
+        writer->Wait();
+    }
+    if (journal) {
+        journal->Remove();
+    }
+}
+
+// Extracts all entries of the archives into a stored ZIP file, each archive under its directory
+// where "." is the root.
+void ExtractZip(const string &zip_path, const vector<pair<string, string>> &archive_directories,
+                const Options &options) {
+    OutputTree tree{options};
+    for (const auto &[iga_path, directory] : archive_directories) {
+        Archive &archive = tree.AddArchive(iga_path);
+        string prefix = GetDirectoryPrefix(directory);
+        for (const auto &entry : archive.entries()) {
+            string path{prefix};
+            AppendOutputName(path, entry.name, options.lowercase);
+            tree.AddEntry(archive, entry, path);
+        }
+    }
+    WriteZip(tree, zip_path, options);
+}
+
+// A plan routes the entries of many archives into one output tree. Each line is a directive, with
+// words separated by spaces, double quotes for words with spaces, and '#' for comments:
+//
+//     archive PATTERN DIRECTORY [if PATH]
+//                                Archives matching the glob PATTERN under the input directory go
+//                                into DIRECTORY, where "{}" is the archive name without extension,
+//                                "." is the top level and "-" skips them. Only the first matching
+//                                directive applies to an archive, and archives are extracted in
+//                                directive order, so later ones win. With "if", the directive only
+//                                applies if PATH exists under the input directory.
+//     lowercase                  Lowercase entry names.
+//     exclude PATTERN            Skip entries whose output path matches PATTERN.
+//     move PATTERN DIRECTORY     Move entries whose output path matches PATTERN into DIRECTORY.
+//     rename PATH NEW_PATH       Rename the entry at PATH to NEW_PATH.
+//
+// exclude, move and rename apply to each output path in the order they appear.
+class Plan {
+public:
+    explicit Plan(const string &path) {
+        ifstream file{path};
+        if (!file) {
+            throw system_error(errno, generic_category(), path);
+        }
+        string line{};
+        for (size_t line_number = 1; getline(file, line); ++line_number) {
+            vector<string> words{};
+            if (!SplitWords(line, words) || !AddDirective(words)) {
+                fprintf(stderr, "%s:%zu: Invalid directive: %s\n", path.c_str(), line_number,
+                        line.c_str());
+                exit(1);
+            }
+        }
+    }
+
+    bool lowercase() const {
+        return lowercase_;
+    }
+
+    // Returns the archives under the input directory with their output directories.
+    vector<pair<string, string>> FindArchives(const string &input_directory) const {
+        vector<pair<string, string>> archives{};
+        unordered_set<string> matched_paths{};
+        for (const auto &rule : archive_rules_) {
+            struct stat status{};
+            if (!rule.condition_path.empty()
+                && stat((input_directory + SEPARATOR + rule.condition_path).c_str(), &status)
+                   == -1) {
+                continue;
+            }
+            string pattern = input_directory + SEPARATOR + rule.pattern;
+            glob_t paths{};
+            int result = glob(pattern.c_str(), 0, nullptr, &paths);
+            if (result != 0 && result != GLOB_NOMATCH) {
+                globfree(&paths);
+                throw runtime_error("Unable to glob: " + pattern);
+            }
+            for (size_t i = 0; i < paths.gl_pathc; ++i) {
+                string path{paths.gl_pathv[i]};
+                if (!matched_paths.insert(path).second || rule.directory == "-") {
+                    continue;
+                }
+                string name{GetFileName(path)};
+                name = name.substr(0, name.rfind('.'));
+                string directory{rule.directory};
+                for (size_t index = directory.find("{}"); index != string::npos;
+                     index = directory.find("{}", index + name.size())) {
+                    directory.replace(index, 2, name);
+                }
+                archives.emplace_back(path, directory);
+            }
+            globfree(&paths);
+        }
+        return archives;
+    }
+
+    // Applies the path rules to an output path, or returns false if it is excluded.
+    bool Route(string &path) const {
+        for (const auto &rule : path_rules_) {
+            switch (rule.type) {
+                case PathRule::EXCLUDE:
+                    if (fnmatch(rule.pattern.c_str(), path.c_str(), FNM_PATHNAME) == 0) {
+                        return false;
+                    }
+                    break;
+                case PathRule::MOVE:
+                    if (fnmatch(rule.pattern.c_str(), path.c_str(), FNM_PATHNAME) == 0) {
+                        path = GetDirectoryPrefix(rule.target) + string{GetFileName(path)};
+                    }
+                    break;
+                case PathRule::RENAME:
+                    if (path == rule.pattern) {
+                        path = rule.target;
+                    }
+                    break;
+            }
+        }
+        return true;
+    }
+
+private:
+    struct ArchiveRule {
+        string pattern;
+        string directory;
+        string condition_path;
+    };
+
+    struct PathRule {
+        enum Type { EXCLUDE, MOVE, RENAME } type;
+        string pattern;
+        string target;
+    };
+
+    // Returns false if the directive is invalid.
+    bool AddDirective(const vector<string> &words) {
+        if (words.empty()) {
+            return true;
+        }
+        const string &directive = words[0];
+        if (directive == "archive" && words.size() == 3) {
+            archive_rules_.push_back({ words[1], words[2], {} });
+        } else if (directive == "archive" && words.size() == 5 && words[3] == "if") {
+            archive_rules_.push_back({ words[1], words[2], words[4] });
+        } else if (directive == "lowercase" && words.size() == 1) {
+            lowercase_ = true;
+        } else if (directive == "exclude" && words.size() == 2) {
+            path_rules_.push_back({ PathRule::EXCLUDE, words[1], {} });
+        } else if (directive == "move" && words.size() == 3) {
+            path_rules_.push_back({ PathRule::MOVE, words[1], words[2] });
+        } else if (directive == "rename" && words.size() == 3) {
+            path_rules_.push_back({ PathRule::RENAME, words[1], words[2] });
+        } else {
+            return false;
+        }
+        return true;
+    }
 
-using namespace std;
+    // Returns false if a quote is not closed.
+    static bool SplitWords(const string &line, vector<string> &words) {
+        size_t i = 0;
+        while (true) {
+            while (i < line.size() && isspace(static_cast<unsigned char>(line[i]))) {
+                ++i;
+            }
+            if (i == line.size() || line[i] == '#') {
+                break;
+            }
+            string word{};
+            if (line[i] == '"') {
+                size_t end = line.find('"', i + 1);
+                if (end == string::npos) {
+                    return false;
+                }
+                word = line.substr(i + 1, end - i - 1);
+                i = end + 1;
+            } else {
+                while (i < line.size() && !isspace(static_cast<unsigned char>(line[i]))) {
+                    word += line[i++];
+                }
+            }
+            words.push_back(word);
+        }
+        return true;
+    }
 
-struct Entry {
-    uint32_t name_offset;
-    uint32_t offset;
-    uint32_t size;
-    string name;
-    string encrypted_name;
-    string path;
+    vector<ArchiveRule> archive_rules_;
+    vector<PathRule> path_rules_;
+    bool lowercase_ = false;
 };
 
-#ifdef _WIN32
-#define SEPARATOR '\\'
-#else
-#define SEPARATOR '/'
-#endif
+// Extracts all archives matched by the plan under the input directory into one output tree, which
+// is written as a stored ZIP file if output ends with ".zip", or as a directory otherwise.
+void ExtractPlan(const string &plan_path, const string &input_directory, const string &output,
+                 const Options &options) {
+    Plan plan{plan_path};
+    bool lowercase = options.lowercase || plan.lowercase();
+    vector<pair<string, string>> archive_directories = plan.FindArchives(input_directory);
+    if (archive_directories.empty()) {
+        cerr << "No archives found in " << input_directory << endl;
+        exit(1);
+    }
+    OutputTree tree{options};
+    for (const auto &[iga_path, directory] : archive_directories) {
+        cout << "Extracting " << iga_path << "..." << endl;
+        Archive &archive = tree.AddArchive(iga_path);
+        string prefix = GetDirectoryPrefix(directory);
+        for (const auto &entry : archive.entries()) {
+            string path{prefix};
+            AppendOutputName(path, entry.name, lowercase);
+            if (plan.Route(path)) {
+                tree.AddEntry(archive, entry, path);
+            }
+        }
+    }
+    if (string_ends_with(output, ".zip")) {
+        WriteZip(tree, output, options);
+    } else {
+        WriteDirectory(tree, output, options);
+    }
+}
 
-#define BUFFER_SIZE 4096u
+// Returns the header of an archive with the entries, whose names, offsets and sizes must be set, and
+// sets their name offsets. If padded_size is larger than the header, zero bytes are inserted before
+// the names length to make up for it: they are leading zero groups of that packed uint32, which
+// readers skip, so that the data can start at a fixed offset.
+string CreateHeader(vector<Entry> &entries, size_t padded_size = 0) {
+    stringstream namesStream{ios::out};
+    uint32_t name_offset = 0;
+    namesStream.exceptions(ios::failbit | ios::badbit);
+    for (auto &entry : entries) {
+        entry.name_offset = name_offset;
+        WritePackedString(namesStream, entry.name);
+        name_offset += entry.name.length();
+    }
+    auto namesString{namesStream.str()};
 
-#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+    stringstream headerStream{ios::out};
+    headerStream.exceptions(ios::failbit | ios::badbit);
+    headerStream.write(reinterpret_cast<const char *>(&IGA_SIGNATURE), sizeof(IGA_SIGNATURE));
+    headerStream.write(reinterpret_cast<const char *>(&IGA_UNKNOWN), sizeof(IGA_UNKNOWN));
+    headerStream.write(reinterpret_cast<const char *>(&IGA_PADDING), sizeof(IGA_PADDING));
 
-bool string_ends_with(const string &str, const string& suffix) {
-    return str.size() >= suffix.size()
-           && str.compare(str.size()-suffix.size(), suffix.size(), suffix) == 0;
+    stringstream entriesStream{ios::out};
+    entriesStream.exceptions(ios::failbit | ios::badbit);
+    for (auto &entry : entries) {
+        WritePackedUint32(entriesStream, entry.name_offset);
+        WritePackedUint32(entriesStream, entry.offset);
+        WritePackedUint32(entriesStream, entry.size);
+    }
+    auto entriesString{entriesStream.str()};
+    uint32_t entriesLength = entriesString.length();
+    WritePackedUint32(headerStream, entriesLength);
+    headerStream.write(entriesString.c_str(), entriesLength);
+
+    stringstream namesLengthStream{ios::out};
+    namesLengthStream.exceptions(ios::failbit | ios::badbit);
+    uint32_t namesLength = namesString.length();
+    WritePackedUint32(namesLengthStream, namesLength);
+    size_t size = static_cast<size_t>(headerStream.tellp()) + namesLengthStream.tellp()
+                  + namesLength;
+    if (padded_size > size) {
+        headerStream << string(padded_size - size, '\0');
+    }
+    headerStream << namesLengthStream.str();
+    headerStream.write(namesString.c_str(), namesLength);
+    return headerStream.str();
 }
 
-const uint8_t IGA_SIGNATURE[4] = { 'I', 'G', 'A', '0' };
-const uint8_t IGA_UNKNOWN[4] = { 0x00, 0x00, 0x00, 0x00 };
-const uint8_t IGA_PADDING[8] = { 0x02, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00 };
-const size_t IGA_ENTRIES_OFFSET = sizeof(IGA_SIGNATURE) + sizeof(IGA_UNKNOWN)
-        + sizeof(IGA_PADDING);
+void Compress(const string &iga_path, const vector<string> &input_paths, size_t jobs) {
+    vector<Entry> entries(input_paths.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i].name = GetFileName(input_paths[i]);
+    }
+
+    ThreadPool pool{jobs};
+    for (size_t i = 0; i < entries.size(); i += MAX_BATCH_ENTRIES) {
+        size_t end = min(entries.size(), i + MAX_BATCH_ENTRIES);
+        pool.Submit([&entries, &input_paths, i, end]() {
+            for (size_t j = i; j < end; ++j) {
+                Entry &entry = entries[j];
+                const string &input_path = input_paths[j];
+                struct stat status{};
+                AddStatsCount(StatsCount::STAT);
+                if (stat(input_path.c_str(), &status) == -1) {
+                    throw system_error(errno, generic_category(), input_path);
+                }
+                if (static_cast<uintmax_t>(status.st_size) > MAX_PACKED_UINT32) {
+                    throw out_of_range("Input file size: " + to_string(status.st_size) + ", path: "
+                                       + input_path);
+                }
+                entry.size = static_cast<uint32_t>(status.st_size);
+            }
+        });
+    }
+    pool.Wait();
 
-string CreateBase36Characters() {
-    string characters{""};
-    for (char c = '0'; c <= '9'; ++c) {
-        characters += c;
+    // Offsets and sizes are 31-bit packed uint32s, and readers add the header size to offsets.
+    uint64_t offset = 0;
+    for (auto &entry : entries) {
+        entry.offset = static_cast<uint32_t>(offset);
+        offset += entry.size;
+        if (offset > MAX_PACKED_UINT32) {
+            throw out_of_range("Archive data size: " + to_string(offset));
+        }
+    }
+    string headerString = CreateHeader(entries);
+    if (offset > MAX_PACKED_UINT32 - headerString.length()) {
+        throw out_of_range("Archive size: " + to_string(headerString.length() + offset));
     }
-    for (char c = 'a'; c <= 'z'; ++c) {
-        characters += c;
+
+    // Every entry has a known slot after the header, so workers can fill them in any order.
+    auto iga_file = make_shared<OutputFile>(iga_path);
+    iga_file->Truncate(headerString.length() + static_cast<size_t>(offset));
+    iga_file->Allocate(headerString.length() + static_cast<size_t>(offset));
+    iga_file->Write(reinterpret_cast<const uint8_t *>(headerString.c_str()), headerString.length(),
+                   0);
+
+    vector<size_t> indices(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        indices[i] = i;
     }
-    return characters;
+    function<void(size_t, uint32_t, uint32_t)> compress_chunk = [&](size_t index, uint32_t begin,
+                                                                     uint32_t end) {
+        const Entry &entry = entries[index];
+        unique_ptr<MappedFile> input_file{};
+        {
+            StatsTimer timer{StatsTime::ENTRY_OPEN};
+            AddStatsCount(StatsCount::MMAP);
+            input_file = make_unique<MappedFile>(input_paths[index]);
+        }
+        if (input_file->size() != entry.size) {
+            throw runtime_error("Input file changed size: " + input_paths[index]);
+        }
+        const uint8_t *key_stream = GetKeyStream(GetCipher(entry.name, false));
+        CryptEntryChunk(input_file->data(), begin, end, key_stream, iga_file,
+                        headerString.length() + entry.offset);
+    };
+    function<void(size_t)> finish_entry = [](size_t) {};
+    ScheduleEntryChunks(pool, entries, indices, compress_chunk, finish_entry);
+    pool.Wait();
 }
 
-const string BASE36_CHARACTERS = CreateBase36Characters();
+#define STREAM_BUFFER_SIZE (1024u * 1024)
 
-extern const unordered_map<string, string> ENCRYPTED_NAMES;
+// Where a tar stream's data starts in the archive, leaving room for a header of a few thousand
+// entries that is written last.
+#define STREAM_HEADER_RESERVE (64u * 1024)
 
-string GetFileName(const string &path) {
-    size_t last_separator_index = path.find_last_of(SEPARATOR);
-    if (last_separator_index == path.size() - 1) {
-        throw invalid_argument(path);
-    } else if (last_separator_index != string::npos) {
-        return path.substr(last_separator_index + 1);
-    } else {
-        return path;
+#define TAR_BLOCK_SIZE 512u
+
+// Reads standard input through a buffer, so that data can be decrypted straight out of it.
+class InputStream {
+public:
+    InputStream() : buffer_(STREAM_BUFFER_SIZE) {}
+
+    InputStream(const InputStream &) = delete;
+    InputStream &operator=(const InputStream &) = delete;
+
+    // Reads a line without its '\n', or returns false at the end of the input.
+    bool ReadLine(string &line) {
+        line.clear();
+        while (begin_ != end_ || Fill()) {
+            auto data = reinterpret_cast<const char *>(buffer_.data());
+            auto newline = static_cast<const char *>(memchr(data + begin_, '\n', end_ - begin_));
+            size_t line_end = newline != nullptr ? newline - data : end_;
+            line.append(data + begin_, line_end - begin_);
+            begin_ = line_end;
+            if (newline != nullptr) {
+                ++begin_;
+                return true;
+            }
+        }
+        return !line.empty();
     }
-}
 
-void Usage(const string &program_name) {
-    cerr << "Usage: " << program_name << " -l IGA_FILE" << endl
-            << "Usage: " << program_name << " -x IGA_FILE [OUTPUT_DIRECOTRY]" << endl
-            << "Usage: " << program_name << " -c IGA_FILE INPUT_FILE..." << endl;
-}
+    // Points data at the next bytes of input, up to max_size, and returns how many, or 0 at the
+    // end of the input. They stay valid until the next read.
+    size_t Read(const uint8_t *&data, size_t max_size) {
+        if (begin_ == end_ && !Fill()) {
+            return 0;
+        }
+        size_t size = min(max_size, end_ - begin_);
+        data = buffer_.data() + begin_;
+        begin_ += size;
+        return size;
+    }
 
-uint32_t ReadPackedUint32(istream &stream) {
-    uint32_t value = 0;
-    while ((value & 1u) == 0) {
-        uint8_t byte;
-        stream.read(reinterpret_cast<char *>(&byte), sizeof(byte));
-        value = value << 7u | byte;
+    void ReadExactly(uint8_t *data, size_t size) {
+        while (size > 0) {
+            const uint8_t *input;
+            size_t read_size = Read(input, size);
+            if (read_size == 0) {
+                throw runtime_error("Unexpected end of input");
+            }
+            memcpy(data, input, read_size);
+            data += read_size;
+            size -= read_size;
+        }
+    }
+
+    void Skip(uint64_t size) {
+        while (size > 0) {
+            const uint8_t *input;
+            size_t read_size = Read(input, min<uint64_t>(size, STREAM_BUFFER_SIZE));
+            if (read_size == 0) {
+                throw runtime_error("Unexpected end of input");
+            }
+            size -= read_size;
+        }
     }
-    return value >> 1u;
-}
 
-bool WritePackedUint32Byte(ostream &stream, uint8_t byte, bool started, bool end) {
-    byte &= 0b01111111u;
-    started |= byte != 0;
-    if (started | end) {
-        byte <<= 1u;
-        if (end) {
-            byte |= 0b00000001u;
+    // Reads the rest of the input, so that whatever writes it doesn't fail on a closed pipe.
+    void Drain() {
+        begin_ = end_;
+        while (Fill()) {
+            begin_ = end_;
         }
-        stream.write(reinterpret_cast<const char *>(&byte), sizeof(byte));
     }
-    return started;
-}
 
-void WritePackedUint32(ostream &stream, uint32_t value) {
-    bool started = false;
-    started |= WritePackedUint32Byte(stream, value >> 28u, started, false);
-    started |= WritePackedUint32Byte(stream, value >> 21u, started, false);
-    started |= WritePackedUint32Byte(stream, value >> 14u, started, false);
-    started |= WritePackedUint32Byte(stream, value >> 7u, started, false);
-    WritePackedUint32Byte(stream, value, started, true);
+private:
+    bool Fill() {
+        while (true) {
+            ssize_t read_size = read(STDIN_FILENO, buffer_.data(), buffer_.size());
+            if (read_size == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw system_error(errno, generic_category(), "stdin");
+            }
+            begin_ = 0;
+            end_ = static_cast<size_t>(read_size);
+            return read_size > 0;
+        }
+    }
+
+    vector<uint8_t> buffer_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+};
+
+// Encrypts the data of the entry as it arrives, passing it on to write(data, size, offset) where
+// offset is in the entry.
+void PackStreamEntry(InputStream &input, const Entry &entry,
+                     const function<void(const uint8_t *, size_t, uint32_t)> &write) {
+    TraceSpan span{"entry", GetEntryTraceArgs(entry, 0, entry.size)};
+    AddStatsCount(StatsCount::ENTRIES);
+    const uint8_t *key_stream = GetKeyStream(GetCipher(entry.name, false));
+    alignas(64) uint8_t buffer[BUFFER_SIZE];
+    for (uint32_t offset = 0; offset < entry.size;) {
+        const uint8_t *data;
+        size_t size = input.Read(data, min(BUFFER_SIZE, entry.size - offset));
+        if (size == 0) {
+            throw runtime_error("Unexpected end of input in entry: " + string{entry.name});
+        }
+        {
+            StatsTimer timer{StatsTime::ENTRY_DECRYPT};
+            CryptAt(buffer, data, size, offset, key_stream);
+        }
+        AddStatsCount(StatsCount::BYTES_DECRYPTED, size);
+        {
+            StatsTimer timer{StatsTime::ENTRY_WRITE};
+            write(buffer, size, offset);
+        }
+        offset += static_cast<uint32_t>(size);
+    }
 }
 
-string ReadPackedString(istream &stream, size_t length) {
-    auto buffer = make_unique<uint8_t[]>(length);
-    for (size_t i = 0; i < length; ++i) {
-        buffer[i] = static_cast<uint8_t>(ReadPackedUint32(stream));
+bool ParseStreamSize(const string &value, uint64_t &size) {
+    if (value.empty() || value.size() > 10 || value.find_first_not_of("0123456789") != string::npos) {
+        return false;
     }
-    // This doesn't handle encoding, but we should have ASCII-only names.
-    string value{reinterpret_cast<char *>(buffer.get()), length};
-    return value;
+    size = stoull(value);
+    return size <= MAX_PACKED_UINT32;
 }
 
-string ReadLastPackedString(istream &stream, size_t end) {
-    auto buffer = make_unique<vector<uint8_t>>();
-    while (static_cast<size_t>(stream.tellg()) < end) {
-        buffer->push_back(static_cast<uint8_t>(ReadPackedUint32(stream)));
+// Packs a manifest of "PATH\tSIZE" lines, an empty line, and then the data of each entry in order.
+// The header is known up front, so it is written first and the output can be a pipe as well.
+void StreamManifest(InputStream &input, const string &iga_path) {
+    deque<string> names{};
+    vector<Entry> entries{};
+    uint64_t offset = 0;
+    string line{};
+    while (input.ReadLine(line) && !line.empty()) {
+        size_t tab_index = line.rfind('\t');
+        uint64_t size;
+        if (tab_index == string::npos || tab_index == 0 || line[tab_index - 1] == SEPARATOR
+            || !ParseStreamSize(line.substr(tab_index + 1), size)) {
+            throw invalid_argument("Invalid manifest line: " + line);
+        }
+        if (offset + size > MAX_PACKED_UINT32) {
+            throw out_of_range("Archive data size: " + to_string(offset + size));
+        }
+        Entry &entry = entries.emplace_back();
+        // Named after the last component of the path, like with -c and tar streams.
+        entry.name = names.emplace_back(GetFileName(string_view{line}.substr(0, tab_index)));
+        entry.offset = static_cast<uint32_t>(offset);
+        entry.size = static_cast<uint32_t>(size);
+        offset += size;
+    }
+    string header = CreateHeader(entries);
+    if (offset > MAX_PACKED_UINT32 - header.size()) {
+        throw out_of_range("Archive size: " + to_string(header.size() + offset));
+    }
+
+    unique_ptr<OutputFile> iga_file{};
+    int fd = STDOUT_FILENO;
+    if (iga_path != "-") {
+        iga_file = make_unique<OutputFile>(iga_path);
+        iga_file->Allocate(header.size() + offset);
+        fd = iga_file->fd();
+    }
+    const string &output_name = iga_file ? iga_path : "stdout";
+    WriteFully(fd, reinterpret_cast<const uint8_t *>(header.data()), header.size(), output_name);
+    for (const auto &entry : entries) {
+        PackStreamEntry(input, entry, [&](const uint8_t *data, size_t data_size, uint32_t) {
+            WriteFully(fd, data, data_size, output_name);
+        });
     }
-    // This doesn't handle encoding, but we should have ASCII-only names.
-    string value{reinterpret_cast<char *>(buffer->data()), buffer->size()};
-    return value;
 }
 
-void WritePackedString(ostream &stream, const string &value) {
-    // This doesn't handle encoding, but we should have ASCII-only names.
-    auto buffer = reinterpret_cast<const uint8_t *>(value.c_str());
-    for (size_t i = 0; i < value.length(); ++i) {
-        WritePackedUint32(stream, static_cast<uint32_t>(buffer[i]));
+// Parses a tar number, which is octal, or base-256 big-endian if the high bit of the first byte is
+// set.
+uint64_t ParseTarNumber(const uint8_t *field, size_t size) {
+    uint64_t value = 0;
+    if (field[0] & 0x80u) {
+        value = field[0] & 0x7Fu;
+        for (size_t i = 1; i < size; ++i) {
+            value = value << 8u | field[i];
+        }
+        return value;
+    }
+    for (size_t i = 0; i < size && field[i] != '\0' && field[i] != ' '; ++i) {
+        if (field[i] < '0' || field[i] > '7') {
+            throw runtime_error("Invalid tar number");
+        }
+        value = value << 3u | (field[i] - '0');
     }
+    return value;
 }
 
-void Extract(const string &iga_path, bool is_list, const string &output_directory) {
-    ifstream iga_file{iga_path, ios::binary};
-    iga_file.exceptions(ios::failbit | ios::badbit);
+string GetTarString(const uint8_t *field, size_t size) {
+    auto data = reinterpret_cast<const char *>(field);
+    return { data, strnlen(data, size) };
+}
 
-    auto signature = make_unique<uint8_t[]>(ARRAY_SIZE(IGA_SIGNATURE));
-    iga_file.read(reinterpret_cast<char *>(signature.get()), sizeof(IGA_SIGNATURE));
-    if (!equal(signature.get(), signature.get() + ARRAY_SIZE(IGA_SIGNATURE), IGA_SIGNATURE)) {
-        fprintf(stderr, "Unexpected signature: 0x%02X%02X%02X%02X\n", signature[0], signature[1],
-                signature[2], signature[3]);
-        exit(1);
+// Returns the value of key in pax extended header records, which are "LENGTH KEY=VALUE\n".
+bool FindPaxValue(const string &records, const string &key, string &value) {
+    for (size_t begin = 0; begin < records.size();) {
+        size_t space_index = records.find(' ', begin);
+        if (space_index == string::npos) {
+            break;
+        }
+        size_t length = stoul(records.substr(begin, space_index - begin));
+        if (length == 0 || begin + length > records.size()) {
+            break;
+        }
+        string record = records.substr(space_index + 1, begin + length - space_index - 2);
+        if (record.compare(0, key.size() + 1, key + "=") == 0) {
+            value = record.substr(key.size() + 1);
+            return true;
+        }
+        begin += length;
     }
+    return false;
+}
 
-    iga_file.seekg(0, ios::end);
-    size_t file_size = iga_file.tellg();
-
-    iga_file.seekg(IGA_ENTRIES_OFFSET);
-    uint32_t entries_length = ReadPackedUint32(iga_file);
-    size_t entries_end = static_cast<size_t>(iga_file.tellg()) + entries_length;
-    vector<Entry> entries{};
-    while (static_cast<size_t>(iga_file.tellg()) < entries_end) {
-        Entry entry{};
-        entry.name_offset = ReadPackedUint32(iga_file);
-        entry.offset = ReadPackedUint32(iga_file);
-        entry.size = ReadPackedUint32(iga_file);
-        entries.push_back(entry);
+// Copies size bytes within the file through a buffer, in ascending order, which is safe for
+// overlapping ranges as long as the destination is before the source.
+void CopyFileRange(const MappedFile &input, OutputFile &output, size_t source, size_t destination,
+                   size_t size) {
+    vector<uint8_t> buffer(min<size_t>(size, STREAM_BUFFER_SIZE));
+    for (size_t done = 0; done < size; done += buffer.size()) {
+        size_t copy_size = min(buffer.size(), size - done);
+        memcpy(buffer.data(), input.data() + source + done, copy_size);
+        output.Write(buffer.data(), copy_size, destination + done);
     }
+}
 
-    uint32_t names_length = ReadPackedUint32(iga_file);
-    size_t names_end = static_cast<size_t>(iga_file.tellg()) + names_length;
-    for (size_t i = 0; i < entries.size(); ++i) {
-        Entry &entry = entries[i];
-        string name;
-        if (i < entries.size() - 1) {
-            size_t name_length = entries[i + 1].name_offset - entry.name_offset;
-            name = ReadPackedString(iga_file, name_length);
-        } else {
-            // Assuming that entry names are in ASCII, the actual number of bytes used in the file
-            // for an entry name should be the same as the difference of name_offset of adjacent
-            // entries. However, Shenghuixinglanxueyuan somehow unnecessarily writes one extra 0
-            // byte before bytes that have their second-highest bit set to 1 (e.g. lower case
-            // letters), but they are still reporting the number of packed uint32s (instead of
-            // actual number of bytes used in the file) for name_offset, so that the file pointer
-            // will no longer be in sync with name_offset and it broke the simple logic of reading
-            // (names_end - name_offset of second last entry） packed uint32s. In this case, we can
-            // only read all the packed uint32s until we meet names_end.
-            name = ReadLastPackedString(iga_file, names_end);
-        }
-        if (name.size() == 12 && name.find_first_not_of(BASE36_CHARACTERS) == string::npos) {
-            entry.encrypted_name = name;
-            const auto &iter = ENCRYPTED_NAMES.find(name);
-            if (iter != ENCRYPTED_NAMES.end()) {
-                entry.name = iter->second;
+// Packs the regular files of a tar stream, named after the last component of their paths. Entries
+// are only known as they arrive, so their data is written from STREAM_HEADER_RESERVE on, and the
+// header is written last, which needs the output to be a regular file.
+void StreamTar(InputStream &input, const string &iga_path) {
+    OutputFile iga_file{iga_path};
+    deque<string> names{};
+    vector<Entry> entries{};
+    vector<uint64_t> positions{};
+    uint64_t position = STREAM_HEADER_RESERVE;
+    string long_path{};
+    string pax_path{};
+    string pax_size{};
+    uint8_t block[TAR_BLOCK_SIZE];
+    while (true) {
+        input.ReadExactly(block, sizeof(block));
+        if (all_of(block, block + sizeof(block), [](uint8_t byte) { return byte == 0; })) {
+            break;
+        }
+        uint64_t checksum = ParseTarNumber(block + 148, 8);
+        uint64_t sum = 0;
+        for (size_t i = 0; i < sizeof(block); ++i) {
+            sum += i >= 148 && i < 156 ? ' ' : block[i];
+        }
+        if (sum != checksum) {
+            throw runtime_error("Invalid tar header checksum");
+        }
+        uint64_t size = ParseTarNumber(block + 124, 12);
+        if (!pax_size.empty() && !ParseStreamSize(pax_size, size)) {
+            throw out_of_range("Tar entry size: " + pax_size);
+        }
+        uint64_t padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        char type = static_cast<char>(block[156]);
+        if (type == 'L' || type == 'x') {
+            // A GNU long name, or pax records, for the next header.
+            string data(size, '\0');
+            input.ReadExactly(reinterpret_cast<uint8_t *>(data.data()), size);
+            input.Skip(padding);
+            if (type == 'L') {
+                long_path = data.substr(0, strnlen(data.c_str(), data.size()));
             } else {
-                cerr << "Warning: Unknown encrypted name: " << name << endl;
-                entry.name = name;
+                FindPaxValue(data, "path", pax_path);
+                FindPaxValue(data, "size", pax_size);
             }
+            continue;
+        }
+        if (type == 'g') {
+            // Global pax records, which don't name anything.
+            input.Skip(size + padding);
+            continue;
+        }
+        string path{};
+        if (!pax_path.empty()) {
+            path = pax_path;
+        } else if (!long_path.empty()) {
+            path = long_path;
         } else {
-            entry.name = name;
+            string prefix = GetTarString(block + 345, 155);
+            path = (prefix.empty() ? "" : prefix + "/") + GetTarString(block, 100);
         }
-        entry.offset += names_end;
-        if (!is_list) {
-            entry.path = output_directory + SEPARATOR + entry.name;
+        long_path.clear();
+        pax_path.clear();
+        pax_size.clear();
+        // Directories, links and devices have no data to pack.
+        if ((type != '0' && type != '\0' && type != '7') || path.empty() || path.back() == '/') {
+            input.Skip(size + padding);
+            continue;
         }
-        if (entry.offset + entry.size > file_size) {
-            throw out_of_range("Entry offset: " + to_string(entry.offset) + ", size: "
-                               + to_string(entry.size) + ", file size: " + to_string(file_size));
+        string_view name = GetFileName(path);
+        if (size > MAX_PACKED_UINT32) {
+            throw out_of_range("Tar entry size: " + to_string(size) + ", path: " + path);
         }
+        Entry &entry = entries.emplace_back();
+        entry.name = names.emplace_back(name);
+        entry.size = static_cast<uint32_t>(size);
+        positions.push_back(position);
+        // Only this entry's range, since allocating from the start of the file each time would
+        // make the total work quadratic in the number of entries.
+        iga_file.Allocate(size, position);
+        PackStreamEntry(input, entry, [&](const uint8_t *data, size_t data_size,
+                                          uint32_t offset) {
+            iga_file.Write(data, data_size, position + offset);
+        });
+        input.Skip(padding);
+        position += size;
     }
+    input.Drain();
 
-    if (is_list) {
-        for (const auto &entry : entries) {
-            cout << entry.name << endl;
+    uint64_t data_size = position - STREAM_HEADER_RESERVE;
+    uint32_t offset = 0;
+    for (auto &entry : entries) {
+        entry.offset = offset;
+        offset += entry.size;
+    }
+    string header = CreateHeader(entries);
+    if (data_size > MAX_PACKED_UINT32 - header.size()) {
+        throw out_of_range("Archive data size: " + to_string(data_size));
+    }
+    if (data_size + header.size() <= STREAM_HEADER_RESERVE) {
+        // Small enough to move the data right after the header, which is then the same as what -c
+        // writes.
+        {
+            MappedFile mapped_file{iga_path};
+            CopyFileRange(mapped_file, iga_file, STREAM_HEADER_RESERVE, header.size(), data_size);
         }
+        iga_file.Truncate(header.size() + data_size);
+        iga_file.Write(reinterpret_cast<const uint8_t *>(header.data()), header.size(), 0);
         return;
     }
-
-    static_assert(BUFFER_SIZE % (UINT8_MAX + 1) == 0,
-            "BUFFER_SIZE must be a multiple of (UINT8_MAX + 1) for decryption to work");
-    auto buffer = make_unique<uint8_t[]>(BUFFER_SIZE);
-    for (const auto &entry : entries) {
-        cout << entry.name << endl;
-        ofstream output_file{entry.path, ios::binary};
-        output_file.exceptions(ios::failbit | ios::badbit);
-        iga_file.seekg(entry.offset);
-        bool is_script = string_ends_with(entry.name, ".s");
-        uint32_t size = 0;
-        while (size < entry.size) {
-            uint32_t transferSize = min(BUFFER_SIZE, entry.size - size);
-            iga_file.read(reinterpret_cast<char *>(buffer.get()), transferSize);
-            for (size_t i = 0; i < transferSize; ++i) {
-                uint8_t key = static_cast<uint8_t>(i + 2);
-                if (is_script) {
-                    key ^= 0xFF;
-                    if (!entry.encrypted_name.empty()) {
-                        key ^= static_cast<uint8_t>(0x5C * (i + 1));
-                    }
-                }
-                buffer[i] ^= key;
+    // Otherwise the data stays where it is and the header is padded up to it. If the header
+    // doesn't fit in the reserve, the entries in its way are moved to the end of the file, which
+    // costs a copy of those entries only.
+    size_t header_size;
+    while (true) {
+        if (position > MAX_PACKED_UINT32) {
+            throw out_of_range("Archive size: " + to_string(position));
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            entries[i].offset = static_cast<uint32_t>(positions[i]);
+        }
+        // Offsets from the start of the file are larger than from the end of the header, so this
+        // header is at least as large as the final one.
+        header_size = CreateHeader(entries).size();
+        if (header_size <= *min_element(positions.begin(), positions.end())) {
+            break;
+        }
+        MappedFile mapped_file{iga_path};
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (positions[i] < header_size) {
+                iga_file.Allocate(entries[i].size, position);
+                CopyFileRange(mapped_file, iga_file, positions[i], position, entries[i].size);
+                positions[i] = position;
+                position += entries[i].size;
             }
-            output_file.write(reinterpret_cast<char *>(buffer.get()), transferSize);
-            size += transferSize;
         }
-        output_file.flush();
     }
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i].offset = static_cast<uint32_t>(positions[i] - header_size);
+    }
+    header = CreateHeader(entries, header_size);
+    iga_file.Write(reinterpret_cast<const uint8_t *>(header.data()), header.size(), 0);
 }
 
-void Compress(const string &iga_path, const vector<string> &input_paths) {
-    ofstream iga_file{iga_path, ios::binary};
-    iga_file.exceptions(ios::failbit | ios::badbit);
+// Packs entries from standard input as they arrive, without staging them in files.
+void StreamCompress(const string &format, const string &iga_path) {
+    InputStream input{};
+    if (format == "manifest") {
+        StreamManifest(input, iga_path);
+    } else {
+        StreamTar(input, iga_path);
+    }
+}
 
-    iga_file.write(reinterpret_cast<const char *>(&IGA_SIGNATURE), sizeof(IGA_SIGNATURE));
-    iga_file.write(reinterpret_cast<const char *>(&IGA_UNKNOWN), sizeof(IGA_UNKNOWN));
-    iga_file.write(reinterpret_cast<const char *>(&IGA_PADDING), sizeof(IGA_PADDING));
+// Reads names from standard input, one per line, and writes a name dictionary for them.
+void CreateNameDictionary(const string &path) {
+    vector<string> names{};
+    string name{};
+    while (getline(cin, name)) {
+        if (!name.empty()) {
+            names.push_back(name);
+        }
+    }
+    vector<pair<uint64_t, size_t>> keys{};
+    keys.reserve(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        keys.emplace_back(EncryptName(names[i]), i);
+    }
+    sort(keys.begin(), keys.end());
 
-    vector<Entry> entries{};
-    for (const auto &input_path : input_paths) {
-        Entry entry{};
-        entry.path = input_path;
+    vector<NamesEntry> entries{};
+    string names_string{};
+    for (size_t i = 0; i < keys.size(); ++i) {
+        const string &key_name = names[keys[i].second];
+        if (!entries.empty() && entries.back().key == keys[i].first) {
+            const string &last_name = names[keys[i - 1].second];
+            if (key_name != last_name) {
+                cerr << "Encrypted name collision: " << key_name << ", " << last_name << endl;
+                exit(1);
+            }
+            continue;
+        }
+        NamesEntry entry{};
+        entry.key = keys[i].first;
+        entry.name_offset = static_cast<uint32_t>(names_string.size());
+        entry.name_length = static_cast<uint32_t>(key_name.size());
         entries.push_back(entry);
+        names_string += key_name;
     }
 
-    stringstream namesStream{ios::out};
-    uint32_t name_offset = 0;
-    namesStream.exceptions(ios::failbit | ios::badbit);
-    for (auto &entry : entries) {
-        entry.name_offset = name_offset;
-        entry.name = GetFileName(entry.path);
-        WritePackedString(namesStream, entry.name);
-        name_offset += entry.name.length();
+    string body{reinterpret_cast<const char *>(entries.data()),
+                entries.size() * sizeof(NamesEntry)};
+    body += names_string;
+    NamesHeader header{};
+    memcpy(header.signature, NAMES_SIGNATURE, sizeof(header.signature));
+    header.fingerprint = HashFnv1a(body.data(), body.size());
+    header.entry_count = entries.size();
+    header.names_length = names_string.size();
+    OutputFile file{path};
+    file.Write(reinterpret_cast<const uint8_t *>(&header), sizeof(header), 0);
+    file.Write(reinterpret_cast<const uint8_t *>(body.data()), body.size(), sizeof(header));
+}
+
+bool ParseJobs(const string &value, size_t &jobs) {
+    if (value.empty() || value.find_first_not_of("0123456789") != string::npos) {
+        return false;
     }
-    auto namesString{namesStream.str()};
+    jobs = stoul(value);
+    if (jobs == 0) {
+        jobs = max(thread::hardware_concurrency(), 1u);
+    }
+    return true;
+}
 
-    uint32_t offset = 0;
-    for (auto &entry : entries) {
-        entry.offset = offset;
-        ifstream input_file{entry.path, ios::binary};
-        input_file.exceptions(ios::failbit | ios::badbit);
-        input_file.seekg(0, ios::end);
-        entry.size = input_file.tellg();
-        offset += entry.size;
+// Parses a size with an optional K or M suffix for --write-size.
+bool ParseWriteSize(const string &value, size_t &write_size) {
+    size_t digits_end = value.find_first_not_of("0123456789");
+    if (digits_end == 0 || value.empty()) {
+        return false;
+    }
+    size_t size = stoul(value.substr(0, digits_end));
+    string suffix = value.substr(min(digits_end, value.size()));
+    if (suffix == "K" || suffix == "k") {
+        size *= 1024;
+    } else if (suffix == "M" || suffix == "m") {
+        size *= 1024 * 1024;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    if (size < MIN_WRITE_SIZE || size > MAX_WRITE_SIZE || size % BUFFER_SIZE != 0) {
+        return false;
     }
+    write_size = size;
+    return true;
+}
 
-    stringstream entriesStream{ios::out};
-    entriesStream.exceptions(ios::failbit | ios::badbit);
-    for (auto &entry : entries) {
-        WritePackedUint32(entriesStream, entry.name_offset);
-        WritePackedUint32(entriesStream, entry.offset);
-        WritePackedUint32(entriesStream, entry.size);
+// Reads what the kernel counts for the process in /proc/self/io, or returns false where it doesn't.
+bool ReadProcessIo(unordered_map<string, uint64_t> &values) {
+    ifstream stream{"/proc/self/io"};
+    string name{};
+    uint64_t value;
+    while (getline(stream, name, ':') && stream >> value) {
+        values[name] = value;
+        stream.ignore(1);
     }
-    auto entriesString{entriesStream.str()};
-    uint32_t entriesLength = entriesString.length();
-    WritePackedUint32(iga_file, entriesLength);
-    iga_file.write(entriesString.c_str(), entriesLength);
+    return !values.empty();
+}
 
-    uint32_t namesLength = namesString.length();
-    WritePackedUint32(iga_file, namesLength);
-    iga_file.write(namesString.c_str(), namesLength);
+// Prints the --stats report as a single line of JSON on standard error, at exit.
+void PrintStats() {
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - stats.start;
+    ostringstream stream{};
+    char number[32];
+    auto append_seconds = [&](const char *name, double seconds) {
+        snprintf(number, sizeof(number), "%.6f", seconds);
+        stream << '"' << name << "\":" << number;
+    };
+    auto append_timeval = [&](const char *name, const timeval &time) {
+        append_seconds(name, time.tv_sec + time.tv_usec / 1e6);
+    };
+    stream << "{\"command\":";
+    AppendJsonString(stream, stats.command);
+    stream << ",\"jobs\":" << stats.jobs << ',';
+    append_seconds("elapsed_seconds", elapsed.count());
+    stream << ",\"times_seconds\":{";
+    for (size_t i = 0; i < static_cast<size_t>(StatsTime::COUNT); ++i) {
+        stream << (i != 0 ? "," : "");
+        append_seconds(STATS_TIME_NAMES[i], stats.times[i] / 1e9);
+    }
+    stream << '}';
+    size_t first_syscall = static_cast<size_t>(FIRST_SYSCALL_STATS_COUNT);
+    for (size_t i = 0; i < first_syscall; ++i) {
+        stream << ",\"" << STATS_COUNT_NAMES[i] << "\":" << stats.counts[i];
+    }
+    stream << ",\"syscalls\":{";
+    for (size_t i = first_syscall; i < static_cast<size_t>(StatsCount::COUNT); ++i) {
+        stream << (i != first_syscall ? "," : "") << '"' << STATS_COUNT_NAMES[i] << "\":"
+               << stats.counts[i];
+    }
+    stream << '}';
+    // All reads and writes of the process, including those of the page cache for mapped files.
+    unordered_map<string, uint64_t> io{};
+    if (ReadProcessIo(io)) {
+        stream << ",\"io\":{\"read_syscalls\":" << io["syscr"] << ",\"write_syscalls\":"
+               << io["syscw"] << ",\"read_bytes\":" << io["read_bytes"] << ",\"write_bytes\":"
+               << io["write_bytes"] << '}';
+    }
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    // ru_maxrss is in kilobytes on Linux.
+    stream << ",\"peak_rss_bytes\":" << static_cast<uint64_t>(usage.ru_maxrss) * 1024 << ',';
+    append_timeval("user_seconds", usage.ru_utime);
+    stream << ',';
+    append_timeval("system_seconds", usage.ru_stime);
+    stream << ",\"minor_faults\":" << usage.ru_minflt << ",\"major_faults\":" << usage.ru_majflt
+           << ",\"voluntary_context_switches\":" << usage.ru_nvcsw
+           << ",\"involuntary_context_switches\":" << usage.ru_nivcsw << '}';
+    cerr << stream.str() << endl;
+}
 
-    static_assert(BUFFER_SIZE % (UINT8_MAX + 1) == 0,
-                  "BUFFER_SIZE must be a multiple of (UINT8_MAX + 1) for encryption to work");
-    auto buffer = make_unique<uint8_t[]>(BUFFER_SIZE);
-    for (auto &entry : entries) {
-        ifstream input_file{entry.path, ios::binary};
-        input_file.exceptions(ios::failbit | ios::badbit);
-        bool is_script = string_ends_with(entry.name, ".s");
-        uint32_t size = 0;
-        while (size < entry.size) {
-            uint32_t transferSize = min(BUFFER_SIZE, entry.size - size);
-            input_file.read(reinterpret_cast<char *>(buffer.get()), transferSize);
-            for (size_t i = 0; i < transferSize; ++i) {
-                uint8_t key;
-                if (is_script) {
-                    key = static_cast<uint8_t>((i + 2) ^ 0xFF);
-                } else {
-                    key = static_cast<uint8_t>(i + 2);
-                }
-                buffer[i] ^= key;
+// Writes the --trace spans of all threads at exit, in the Chrome trace event format that
+// chrome://tracing and Perfetto open.
+void WriteTrace() {
+    int pid = getpid();
+    auto get_microseconds = [](chrono::steady_clock::duration duration) {
+        char microseconds[32];
+        snprintf(microseconds, sizeof(microseconds), "%.3f",
+                 chrono::duration<double, micro>(duration).count());
+        return string{microseconds};
+    };
+    ofstream stream{trace.path};
+    stream << "{\"traceEvents\":[";
+    bool is_first = true;
+    auto begin_event = [&](const char *name, char phase, size_t thread_id) {
+        stream << (is_first ? "\n" : ",\n") << "{\"name\":\"" << name << "\",\"ph\":\"" << phase
+               << "\",\"pid\":" << pid << ",\"tid\":" << thread_id;
+        is_first = false;
+    };
+    for (const auto &thread : trace.threads) {
+        if (!thread.name.empty()) {
+            begin_event("thread_name", 'M', thread.id);
+            stream << ",\"args\":{\"name\":" << GetJsonString(thread.name) << "}}";
+        }
+        for (const auto &event : thread.events) {
+            begin_event(event.name, event.phase, thread.id);
+            if (event.phase == 'b') {
+                // The matching end, which must have the same name and id.
+                stream << ",\"cat\":\"io\",\"id\":" << event.id << ",\"ts\":"
+                       << get_microseconds(event.start - trace.start) << ",\"args\":{" << event.args
+                       << "}}";
+                begin_event(event.name, 'e', thread.id);
+                stream << ",\"cat\":\"io\",\"id\":" << event.id << ",\"ts\":"
+                       << get_microseconds(event.end - trace.start) << '}';
+                continue;
             }
-            iga_file.write(reinterpret_cast<char *>(buffer.get()), transferSize);
-            size += transferSize;
+            stream << ",\"ts\":" << get_microseconds(event.start - trace.start) << ",\"dur\":"
+                   << get_microseconds(event.end - event.start) << ",\"args\":{" << event.args
+                   << "}}";
         }
     }
-    iga_file.flush();
+    stream << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    stream.flush();
+    if (!stream) {
+        cerr << "Warning: Unable to write trace: " << trace.path << endl;
+    }
 }
 
-int main(int argc, char *argv[]) {
+// Flushes the file system holding path once, instead of flushing every extracted file.
+void SyncFileSystem(const string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw system_error(errno, generic_category(), path);
+    }
+#ifdef __linux__
+    int result = syncfs(fd);
+#else
+    int result = fsync(fd);
+    sync();
+#endif
+    int error = errno;
+    close(fd);
+    if (result == -1) {
+        throw system_error(error, generic_category(), path);
+    }
+}
+
+int RunCommand(int argc, char *argv[]) {
     if (argc < 2) {
-        Usage(argv[1]);
+        Usage(argv[0]);
         return 1;
     }
     string argv1{argv[1]};
+    Options options{};
+    int argi = 2;
+    for (; argi < argc; ++argi) {
+        string option{argv[argi]};
+        if (option == "-j" && argi + 1 < argc) {
+            if (!ParseJobs(argv[++argi], options.jobs)) {
+                Usage(argv[0]);
+                return 1;
+            }
+        } else if (option == "--index-cache" && argi + 1 < argc) {
+            options.index_directory = argv[++argi];
+        } else if (option == "--names" && argi + 1 < argc) {
+            options.name_dictionaries.emplace_back(argv[++argi]);
+        } else if (option == "--io-uring") {
+            options.io_uring = true;
+        } else if (option == "--lowercase") {
+            options.lowercase = true;
+        } else if (option == "--write-size" && argi + 1 < argc) {
+            if (!ParseWriteSize(argv[++argi], options.write_size)) {
+                Usage(argv[0]);
+                return 1;
+            }
+        } else if (option == "--stats" && argi + 1 < argc) {
+            if (string{argv[++argi]} != "json") {
+                Usage(argv[0]);
+                return 1;
+            }
+            stats.enabled = true;
+        } else if (option == "--trace" && argi + 1 < argc) {
+            trace.enabled = true;
+            trace.path = argv[++argi];
+        } else if (option == "--sync") {
+            options.sync = true;
+        } else if (option == "--incremental") {
+            options.incremental = true;
+        } else if (option == "--verify") {
+            options.incremental = true;
+            options.verify = true;
+        } else if (option == "--guess" && argi + 1 < argc) {
+            try {
+                options.name_patterns.emplace_back(argv[++argi]);
+            } catch (const invalid_argument &e) {
+                cerr << e.what() << endl;
+                Usage(argv[0]);
+                return 1;
+            }
+        } else {
+            if (option == "--") {
+                ++argi;
+            }
+            break;
+        }
+    }
+    vector<string> arguments{argv + argi, argv + argc};
+    if (stats.enabled) {
+        stats.command = argv1;
+        stats.jobs = options.jobs;
+        stats.start = chrono::steady_clock::now();
+        atexit(PrintStats);
+    }
+    if (trace.enabled) {
+        trace.start = chrono::steady_clock::now();
+        SetTraceThreadName("main");
+        atexit(WriteTrace);
+    }
     if (argv1 == "-l") {
-        if (argc != 3) {
+        if (arguments.size() != 1) {
             Usage(argv[0]);
             return 1;
         }
-        Extract(argv[2], true, ".");
+        Extract(arguments[0], options, true, ".", {});
         return 0;
     } else if (argv1 == "-x") {
-        if (!(argc == 3 || argc == 4)) {
+        if (arguments.empty()) {
+            Usage(argv[0]);
+            return 1;
+        }
+        string output_directory = arguments.size() >= 2 ? arguments[1] : ".";
+        vector<string> names{arguments.begin() + min<size_t>(arguments.size(), 2),
+                             arguments.end()};
+        Extract(arguments[0], options, false, output_directory, names);
+        if (options.sync) {
+            SyncFileSystem(output_directory);
+        }
+        return 0;
+    } else if (argv1 == "-p") {
+        if (arguments.size() < 2) {
             Usage(argv[0]);
             return 1;
         }
-        string output_directory = argc == 4 ? argv[3] : ".";
-        Extract(argv[2], false, output_directory);
+        vector<string> names{arguments.begin() + 1, arguments.end()};
+        Print(arguments[0], options, names);
         return 0;
     } else if (argv1 == "-c") {
-        if (argc < 3) {
+        if (arguments.empty()) {
+            Usage(argv[0]);
+            return 1;
+        }
+        vector<string> input_files{arguments.begin() + 1, arguments.end()};
+        Compress(arguments[0], input_files, options.jobs);
+        return 0;
+    } else if (argv1 == "-z") {
+        if (arguments.size() < 3 || arguments.size() % 2 != 1) {
+            Usage(argv[0]);
+            return 1;
+        }
+        vector<pair<string, string>> archive_directories{};
+        for (size_t i = 1; i < arguments.size(); i += 2) {
+            archive_directories.emplace_back(arguments[i], arguments[i + 1]);
+        }
+        ExtractZip(arguments[0], archive_directories, options);
+        if (options.sync) {
+            SyncFileSystem(arguments[0]);
+        }
+        return 0;
+    } else if (argv1 == "--plan") {
+        if (arguments.size() != 3) {
+            Usage(argv[0]);
+            return 1;
+        }
+        ExtractPlan(arguments[0], arguments[1], arguments[2], options);
+        if (options.sync) {
+            SyncFileSystem(arguments[2]);
+        }
+        return 0;
+    } else if (argv1 == "--stream") {
+        if (arguments.size() != 2 || (arguments[0] != "tar" && arguments[0] != "manifest")) {
             Usage(argv[0]);
             return 1;
         }
-        vector<string> input_files{};
-        for (int i = 3; i < argc; ++i) {
-            input_files.emplace_back(argv[i]);
+        if (arguments[0] == "tar" && arguments[1] == "-") {
+            cerr << "Packing a tar stream needs a regular output file" << endl;
+            return 1;
+        }
+        StreamCompress(arguments[0], arguments[1]);
+        return 0;
+    } else if (argv1 == "-n") {
+        if (arguments.size() != 1) {
+            Usage(argv[0]);
+            return 1;
         }
-        Compress(argv[2], input_files);
+        CreateNameDictionary(arguments[0]);
         return 0;
     } else {
         Usage(argv[0]);
         return 1;
     }
 }
+
+// Errors that end a command, such as an archive that is missing or corrupt, are reported instead
+// of aborting.
+int main(int argc, char *argv[]) {
+    try {
+        return RunCommand(argc, argv);
+    } catch (const exception &e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+}
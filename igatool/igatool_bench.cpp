@@ -0,0 +1,495 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "iga.h"
+
+#ifndef IGATOOL_PATH
+#define IGATOOL_PATH "./igatool"
+#endif
+
+#define DATA_BUFFER_SIZE (1024u * 1024)
+
+#define DEFAULT_REPEAT_COUNT 3u
+
+using namespace std;
+
+extern char **environ;
+
+// What a synthetic archive looks like. Sizes are spread log-uniformly between min_size and
+// max_size, so a wide range has as many small entries as large ones.
+struct GeneratorOptions {
+    string profile = "custom";
+    size_t entry_count = 1000;
+    size_t min_size = 1024;
+    size_t max_size = 1024 * 1024;
+    // Fractions of the entries that are scripts, and that have encrypted names.
+    double script_ratio = 0;
+    double encrypted_name_ratio = 0;
+    // Shenghuixinglanxueyuan writes an extra 0 byte before name characters with bit 6 set.
+    bool name_quirk = false;
+    uint64_t seed = 1;
+};
+
+// Presets for the kinds of archives the games ship.
+GeneratorOptions GetProfile(const string &name) {
+    GeneratorOptions options{};
+    options.profile = name;
+    if (name == "scripts") {
+        options.entry_count = 20000;
+        options.min_size = 256;
+        options.max_size = 64 * 1024;
+        options.script_ratio = 1;
+        options.encrypted_name_ratio = 0.5;
+        options.name_quirk = true;
+    } else if (name == "images") {
+        options.entry_count = 500;
+        options.min_size = 64 * 1024;
+        options.max_size = 4 * 1024 * 1024;
+    } else if (name == "videos") {
+        options.entry_count = 4;
+        options.min_size = 32 * 1024 * 1024;
+        options.max_size = 128 * 1024 * 1024;
+    } else {
+        throw invalid_argument("Unknown profile: " + name);
+    }
+    return options;
+}
+
+// SplitMix64, so that archives only depend on the seed and not on the standard library.
+class Random {
+public:
+    explicit Random(uint64_t seed) : state_(seed) {}
+
+    uint64_t Next() {
+        uint64_t value = (state_ += UINT64_C(0x9E3779B97F4A7C15));
+        value = (value ^ (value >> 30u)) * UINT64_C(0xBF58476D1CE4E5B9);
+        value = (value ^ (value >> 27u)) * UINT64_C(0x94D049BB133111EB);
+        return value ^ (value >> 31u);
+    }
+
+    // Returns a number in [0, 1).
+    double NextDouble() {
+        return static_cast<double>(Next() >> 11u) * 0x1.0p-53;
+    }
+
+    void Fill(uint8_t *data, size_t size) {
+        for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+            uint64_t value = Next();
+            memcpy(data + i, &value, min(sizeof(value), size - i));
+        }
+    }
+
+private:
+    uint64_t state_;
+};
+
+string FormatEncryptedName(uint64_t key) {
+    string encrypted_name(12, '0');
+    for (size_t i = encrypted_name.size(); i-- > 0; key /= 36) {
+        uint64_t digit = key % 36;
+        encrypted_name[i] = static_cast<char>(digit < 10 ? '0' + digit : 'a' + digit - 10);
+    }
+    return encrypted_name;
+}
+
+struct GeneratedEntry {
+    // The name in the archive, and the name it is extracted as.
+    string name;
+    string output_name;
+    uint32_t size;
+    Cipher cipher;
+};
+
+// Writes a synthetic archive, and returns its entries.
+vector<GeneratedEntry> GenerateArchive(const GeneratorOptions &options, const string &path) {
+    Random random{options.seed};
+    vector<pair<uint64_t, string_view>> encrypted_names = ListEncryptedNames();
+    // Shuffle so that each encrypted name is used at most once.
+    for (size_t i = encrypted_names.size(); i > 1; --i) {
+        swap(encrypted_names[i - 1], encrypted_names[random.Next() % i]);
+    }
+    size_t next_encrypted_name = 0;
+
+    vector<GeneratedEntry> entries(options.entry_count);
+    double log_min_size = log(static_cast<double>(options.min_size));
+    double log_max_size = log(static_cast<double>(options.max_size));
+    for (size_t i = 0; i < entries.size(); ++i) {
+        GeneratedEntry &entry = entries[i];
+        double size = exp(log_min_size + (log_max_size - log_min_size) * random.NextDouble());
+        entry.size = static_cast<uint32_t>(min(size, static_cast<double>(options.max_size)));
+        bool is_script = random.NextDouble() < options.script_ratio;
+        if (random.NextDouble() < options.encrypted_name_ratio
+            && next_encrypted_name < encrypted_names.size()) {
+            const auto &[key, name] = encrypted_names[next_encrypted_name++];
+            entry.name = FormatEncryptedName(key);
+            entry.output_name = name;
+            entry.cipher = GetCipher(name, true);
+        } else {
+            char name[32];
+            snprintf(name, sizeof(name), is_script ? "bench_%06zu.s" : "bench_%06zu.dat", i);
+            entry.name = name;
+            entry.output_name = name;
+            entry.cipher = GetCipher(name, false);
+        }
+    }
+
+    ostringstream entries_stream{};
+    ostringstream names_stream{};
+    uint32_t name_offset = 0;
+    uint32_t data_offset = 0;
+    for (const auto &entry : entries) {
+        WritePackedUint32(entries_stream, name_offset);
+        WritePackedUint32(entries_stream, data_offset);
+        WritePackedUint32(entries_stream, entry.size);
+        for (char c : entry.name) {
+            if (options.name_quirk && (c & 0x40) != 0) {
+                names_stream.put(0);
+            }
+            WritePackedUint32(names_stream, static_cast<uint8_t>(c));
+        }
+        name_offset += static_cast<uint32_t>(entry.name.size());
+        if (data_offset > MAX_PACKED_UINT32 - entry.size) {
+            throw out_of_range("Archive too large");
+        }
+        data_offset += entry.size;
+    }
+    string entries_string = entries_stream.str();
+    string names_string = names_stream.str();
+    // Readers add the header size to the offsets, so the whole archive must fit as well. The two
+    // table lengths take at most 5 bytes each.
+    if (data_offset > MAX_PACKED_UINT32 - IGA_ENTRIES_OFFSET - 2 * 5 - entries_string.size()
+                      - names_string.size()) {
+        throw out_of_range("Archive too large");
+    }
+
+    ofstream stream{path, ios::binary};
+    stream.exceptions(ios::failbit | ios::badbit);
+    stream.write(reinterpret_cast<const char *>(IGA_SIGNATURE), sizeof(IGA_SIGNATURE));
+    stream.write(reinterpret_cast<const char *>(IGA_UNKNOWN), sizeof(IGA_UNKNOWN));
+    stream.write(reinterpret_cast<const char *>(IGA_PADDING), sizeof(IGA_PADDING));
+    WritePackedUint32(stream, static_cast<uint32_t>(entries_string.size()));
+    stream << entries_string;
+    WritePackedUint32(stream, static_cast<uint32_t>(names_string.size()));
+    stream << names_string;
+    vector<uint8_t> buffer(DATA_BUFFER_SIZE);
+    for (const auto &entry : entries) {
+        const uint8_t *key_stream = GetKeyStream(entry.cipher);
+        for (uint32_t offset = 0; offset < entry.size; offset += DATA_BUFFER_SIZE) {
+            size_t size = min(DATA_BUFFER_SIZE, entry.size - offset);
+            random.Fill(buffer.data(), size);
+            CryptAt(buffer.data(), buffer.data(), size, offset, key_stream);
+            stream.write(reinterpret_cast<const char *>(buffer.data()),
+                         static_cast<streamsize>(size));
+        }
+    }
+    return entries;
+}
+
+// Runs a command with its output discarded, and throws if it fails.
+void RunCommand(const vector<string> &arguments) {
+    vector<char *> argv{};
+    for (const auto &argument : arguments) {
+        argv.push_back(const_cast<char *>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    posix_spawn_file_actions_addopen(&file_actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&file_actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int error = posix_spawn(&pid, argv[0], &file_actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&file_actions);
+    if (error != 0) {
+        throw system_error(error, generic_category(), arguments[0]);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            throw system_error(errno, generic_category(), "waitpid");
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw runtime_error("Command failed: " + arguments[0] + " " + arguments[1]);
+    }
+}
+
+// Returns the best wall time of repeat_count runs, calling prepare() untimed before each.
+double TimeCommand(const vector<string> &arguments, size_t repeat_count,
+                   const function<void()> &prepare) {
+    double best_seconds = INFINITY;
+    for (size_t i = 0; i < repeat_count; ++i) {
+        prepare();
+        auto start = chrono::steady_clock::now();
+        RunCommand(arguments);
+        chrono::duration<double> duration = chrono::steady_clock::now() - start;
+        best_seconds = min(best_seconds, duration.count());
+    }
+    return best_seconds;
+}
+
+struct BenchOptions {
+    string igatool_path = IGATOOL_PATH;
+    string work_directory;
+    string jobs = "1";
+    size_t repeat_count = DEFAULT_REPEAT_COUNT;
+    // igatool options to extract with, one set per variant, e.g. "--write-size 8M --sync".
+    vector<string> extract_variants;
+};
+
+void PrintResult(const GeneratorOptions &generator_options, const char *operation,
+                 double seconds, uint64_t total_size, const string &variant = {}) {
+    printf("%-8s %8zu %10.1f  %-9s %9.4f %10.1f %12.0f  %s\n",
+           generator_options.profile.c_str(), generator_options.entry_count, total_size / 1e6,
+           operation, seconds, total_size / 1e6 / seconds, generator_options.entry_count / seconds,
+           variant.c_str());
+    fflush(stdout);
+}
+
+vector<string> SplitOptions(const string &options) {
+    vector<string> words{};
+    istringstream stream{options};
+    for (string word{}; stream >> word;) {
+        words.push_back(word);
+    }
+    return words;
+}
+
+// Generates an archive for the profile, and times listing, extracting and compressing it.
+void RunBench(const GeneratorOptions &generator_options, const BenchOptions &options) {
+    filesystem::path directory = filesystem::path{options.work_directory}
+                                 / generator_options.profile;
+    filesystem::remove_all(directory);
+    filesystem::create_directories(directory);
+    string iga_path = directory / "input.iga";
+    vector<GeneratedEntry> entries = GenerateArchive(generator_options, iga_path);
+    uint64_t total_size = 0;
+    for (const auto &entry : entries) {
+        total_size += entry.size;
+    }
+    auto none = [] {};
+
+    double seconds = TimeCommand({ options.igatool_path, "-l", iga_path },
+                                 options.repeat_count, none);
+    PrintResult(generator_options, "list", seconds, total_size);
+
+    string output_directory = directory / "output";
+    vector<string> extract_variants = options.extract_variants;
+    if (extract_variants.empty()) {
+        extract_variants.emplace_back();
+    }
+    for (const auto &variant : extract_variants) {
+        vector<string> extract_arguments{ options.igatool_path, "-x", "-j", options.jobs };
+        for (auto &option : SplitOptions(variant)) {
+            extract_arguments.push_back(move(option));
+        }
+        extract_arguments.insert(extract_arguments.end(), { iga_path, output_directory });
+        seconds = TimeCommand(extract_arguments, options.repeat_count, [&] {
+            filesystem::remove_all(output_directory);
+            filesystem::create_directory(output_directory);
+        });
+        PrintResult(generator_options, "extract", seconds, total_size, variant);
+    }
+
+    string compressed_path = directory / "compressed.iga";
+    vector<string> compress_arguments{ options.igatool_path, "-c", "-j", options.jobs,
+                                       compressed_path };
+    for (const auto &entry : entries) {
+        compress_arguments.push_back(output_directory + "/" + entry.output_name);
+    }
+    seconds = TimeCommand(compress_arguments, options.repeat_count, none);
+    PrintResult(generator_options, "compress", seconds, total_size);
+
+    filesystem::remove_all(directory);
+}
+
+void Usage(const string &program_name) {
+    cerr << "Usage: " << program_name << " generate [GENERATOR_OPTION...] IGA_FILE" << endl
+         << "Usage: " << program_name
+         << " run [GENERATOR_OPTION...] [-j JOBS] [--repeat COUNT] [--igatool PATH]"
+            " [--work-directory DIRECTORY] [--extract-variant OPTIONS]..." << endl
+         << "Generator options: --profile scripts|images|videos, --entries COUNT,"
+            " --min-size SIZE, --max-size SIZE, --scripts RATIO, --encrypted-names RATIO,"
+            " --name-quirk, --seed SEED" << endl;
+}
+
+// Parses a size in bytes with an optional K, M or G suffix.
+bool ParseSize(const string &value, size_t &size) {
+    size_t digits_end = value.find_first_not_of("0123456789");
+    if (digits_end == 0 || value.empty()) {
+        return false;
+    }
+    size = stoul(value.substr(0, digits_end));
+    string suffix = value.substr(min(digits_end, value.size()));
+    if (suffix == "K" || suffix == "k") {
+        size *= 1024;
+    } else if (suffix == "M" || suffix == "m") {
+        size *= 1024 * 1024;
+    } else if (suffix == "G" || suffix == "g") {
+        size *= 1024 * 1024 * 1024;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    return true;
+}
+
+bool ParseRatio(const string &value, double &ratio) {
+    char *end;
+    ratio = strtod(value.c_str(), &end);
+    return !value.empty() && *end == '\0' && ratio >= 0 && ratio <= 1;
+}
+
+int RunMode(int argc, char *argv[]) {
+    if (argc < 2) {
+        Usage(argv[0]);
+        return 1;
+    }
+    string mode{argv[1]};
+    vector<GeneratorOptions> profiles{};
+    GeneratorOptions custom{};
+    bool is_custom = false;
+    BenchOptions options{};
+    int argi = 2;
+    for (; argi < argc; ++argi) {
+        string option{argv[argi]};
+        bool has_value = argi + 1 < argc;
+        bool is_valid = true;
+        if (option == "--profile" && has_value) {
+            try {
+                profiles.push_back(GetProfile(argv[++argi]));
+            } catch (const invalid_argument &e) {
+                cerr << e.what() << endl;
+                is_valid = false;
+            }
+        } else if (option == "--entries" && has_value) {
+            is_valid = ParseSize(argv[++argi], custom.entry_count);
+            is_custom = true;
+        } else if (option == "--min-size" && has_value) {
+            is_valid = ParseSize(argv[++argi], custom.min_size) && custom.min_size > 0;
+            is_custom = true;
+        } else if (option == "--max-size" && has_value) {
+            is_valid = ParseSize(argv[++argi], custom.max_size) && custom.max_size <= MAX_PACKED_UINT32;
+            is_custom = true;
+        } else if (option == "--scripts" && has_value) {
+            is_valid = ParseRatio(argv[++argi], custom.script_ratio);
+            is_custom = true;
+        } else if (option == "--encrypted-names" && has_value) {
+            is_valid = ParseRatio(argv[++argi], custom.encrypted_name_ratio);
+            is_custom = true;
+        } else if (option == "--name-quirk") {
+            custom.name_quirk = true;
+            is_custom = true;
+        } else if (option == "--seed" && has_value) {
+            custom.seed = strtoull(argv[++argi], nullptr, 10);
+        } else if (option == "-j" && has_value) {
+            options.jobs = argv[++argi];
+        } else if (option == "--repeat" && has_value) {
+            is_valid = ParseSize(argv[++argi], options.repeat_count) && options.repeat_count > 0;
+        } else if (option == "--igatool" && has_value) {
+            options.igatool_path = argv[++argi];
+        } else if (option == "--work-directory" && has_value) {
+            options.work_directory = argv[++argi];
+        } else if (option == "--extract-variant" && has_value) {
+            options.extract_variants.emplace_back(argv[++argi]);
+        } else {
+            break;
+        }
+        if (!is_valid) {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+    if (custom.min_size > custom.max_size) {
+        Usage(argv[0]);
+        return 1;
+    }
+    for (auto &profile : profiles) {
+        profile.seed = custom.seed;
+    }
+    if (is_custom || (mode == "generate" && profiles.empty())) {
+        profiles.push_back(custom);
+    }
+    vector<string> arguments{argv + argi, argv + argc};
+
+    if (mode == "generate") {
+        if (arguments.size() != 1 || profiles.size() != 1) {
+            Usage(argv[0]);
+            return 1;
+        }
+        GenerateArchive(profiles[0], arguments[0]);
+        return 0;
+    } else if (mode == "run") {
+        if (!arguments.empty()) {
+            Usage(argv[0]);
+            return 1;
+        }
+        if (profiles.empty()) {
+            for (const char *name : { "scripts", "images", "videos" }) {
+                profiles.push_back(GetProfile(name));
+                profiles.back().seed = custom.seed;
+            }
+        }
+        bool is_temporary = options.work_directory.empty();
+        if (is_temporary) {
+            string pattern = (filesystem::temp_directory_path() / "igatool_bench.XXXXXX");
+            if (mkdtemp(pattern.data()) == nullptr) {
+                throw system_error(errno, generic_category(), pattern);
+            }
+            options.work_directory = pattern;
+        }
+        printf("%s -j %s, best of %zu\n", options.igatool_path.c_str(), options.jobs.c_str(),
+               options.repeat_count);
+        printf("%-8s %8s %10s  %-9s %9s %10s %12s  %s\n", "PROFILE", "ENTRIES", "MB",
+               "OPERATION", "SECONDS", "MB/S", "ENTRIES/S", "OPTIONS");
+        try {
+            for (const auto &profile : profiles) {
+                RunBench(profile, options);
+            }
+        } catch (...) {
+            // Don't leave the generated archives behind in a directory the user never named.
+            if (is_temporary) {
+                filesystem::remove_all(options.work_directory);
+            }
+            throw;
+        }
+        if (is_temporary) {
+            filesystem::remove_all(options.work_directory);
+        }
+        return 0;
+    } else {
+        Usage(argv[0]);
+        return 1;
+    }
+}
+
+// A failed igatool run or an unusable work directory ends the benchmark with its error instead of
+// aborting.
+int main(int argc, char *argv[]) {
+    try {
+        return RunMode(argc, argv);
+    } catch (const exception &e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+}